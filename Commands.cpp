@@ -6,10 +6,25 @@
 #include <sys/wait.h>
 #include <iomanip>
 #include "Commands.h"
+#include "launcher.h"
+#include "copy.h"
+#include "parallel.h"
+#include "uring.h"
+#include <sys/mman.h>
 #include <dirent.h>
 #include <regex>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "signals.h"
+#include <sys/timerfd.h>
 
 using std::cout;
 using std::endl;
@@ -19,8 +34,6 @@ using std::string;
 using std::stoi;
 using std::invalid_argument;
 
-const std::string WHITESPACE = " \n\r\t\f\v";
-
 #if 0
 #define FUNC_ENTRY()  \
   cerr << __PRETTY_FUNCTION__ << " --> " << endl;
@@ -42,104 +55,362 @@ int execvp(const char* file, const char* const (&argv)[N]) {
   return execvp(file, const_cast<char* const*>(argv));
 }
 
-string _ltrim(const std::string& s)
-{
-  size_t start = s.find_first_not_of(WHITESPACE);
-  return (start == std::string::npos) ? "" : s.substr(start);
-}
+const std::string SHELL_METACHARS = "|&;<>()$`\\\"'*?[]#~{}!";
 
-string _rtrim(const std::string& s)
-{
-  size_t end = s.find_last_not_of(WHITESPACE);
-  return (end == std::string::npos) ? "" : s.substr(0, end + 1);
+bool _needsShell(const char* exec, char** args) {
+  /* A line that has no quoting, globbing, expansions or operators is split by bash exactly like
+  parseLine splits it, so we can exec the words directly and skip the bash startup.
+  A '=' in the first word is a variable assignment, which only bash understands. */
+  return strpbrk(exec, SHELL_METACHARS.c_str()) != nullptr || !args[0] || strchr(args[0], '=') != nullptr;
 }
 
-string _trim(const std::string& s)
-{
-  return _rtrim(_ltrim(s));
+static pid_t _launchCommand(Command* cmd, Launcher& launcher) {
+  /* If the direct exec fails (not found, a script without a shebang...) we fall back to bash,
+  so the error messages and behaviour stay exactly like before. */
+  SmallShell& smash = SmallShell::getInstance();
+  if (ParallelCommand* parallel = dynamic_cast<ParallelCommand*>(cmd)) { // Ours, bash wouldn't know it.
+    return parallel->spawn(launcher);
+  }
+  if (!_needsShell(cmd->getExec(), cmd->getArgs())) {
+    char** args = cmd->getArgs();
+    /* Names with a slash are not searched for. Names that are not in $PATH may still be a bash builtin or keyword. */
+    const char* path = strchr(args[0], '/') ? args[0] : smash.lookupPath(args[0]);
+    pid_t pid = path ? launcher.spawn(path, args) : -1;
+    if (pid != -1) {
+      smash.countLaunch(true);
+      return pid;
+    }
+  }
+  const char* const bash_args[] = {"/bin/bash", "-c", cmd->getExec(), nullptr};
+  pid_t pid = launcher.spawn("/bin/bash", const_cast<char* const*>(bash_args));
+  if (pid == -1) {
+    perror("smash error: posix_spawn failed");
+    return -1;
+  }
+  smash.countLaunch(false);
+  return pid;
 }
 
-int _parseCommandLine(const char* cmd_line, char** args) {
-  FUNC_ENTRY()
-  int i = 0;
-  std::istringstream iss(_trim(string(cmd_line)).c_str());
-  for(std::string s; iss >> s; ) {
-    args[i] = (char*)malloc(s.length()+1);
-    memset(args[i], 0, s.length()+1);
-    strcpy(args[i], s.c_str());
-    args[++i] = NULL;
-  }
-  return i;
 
-  FUNC_EXIT()
+static bool _isTransient(Command* cmd) {
+  /* Nothing refers to these once they ran (jobs keep the commands they launched, not these), so whoever runs them deletes them.
+  Other commands may already be deleted by the time execute returns, so ask before running. */
+  return dynamic_cast<BuiltInCommand*>(cmd) || dynamic_cast<PipeCommand*>(cmd) || dynamic_cast<RedirectionCommand*>(cmd);
 }
 
-bool _isBackgroundComamnd(const char* cmd_line) {
-  const string str(cmd_line);
-  return str[str.find_last_not_of(WHITESPACE)] == '&';
+static bool _actsOnShell(Command* cmd) {
+  /* These change the shell, or act on its jobs. In a forked pipe stage they would do it to the copy
+  (quit kill there kills the real shell's jobs, and only the copy exits), so like bash's job control in a subshell, they don't run. */
+  return dynamic_cast<QuitCommand*>(cmd) || dynamic_cast<ForegroundCommand*>(cmd) || dynamic_cast<BackgroundCommand*>(cmd) ||
+         dynamic_cast<KillCommand*>(cmd) || dynamic_cast<ChangeDirCommand*>(cmd) || dynamic_cast<ChangePromptCommand*>(cmd);
+}
+
+Command::Command(const char* line, char** args, int args_len, char* exec) : 
+  cmd_line(string(line)), args(args), args_len(args_len), exec(exec) {
+  }
+
+void Command::cleanup() {
+  free(block); // Anything that was never compacted lives in the shell's line arena.
+  block = nullptr;
 }
 
-void _removeBackgroundSign(char* cmd_line) {
-  const string str(cmd_line);
-  // find last character other than spaces
-  unsigned int idx = str.find_last_not_of(WHITESPACE);
-  // if all characters are spaces then return
-  if (idx == string::npos) {
+void Command::compact() {
+  /* Moves args and exec from the line arena into one block owned by the command,
+  for commands that outlive their line (jobs, timeouts). */
+  if (block) {
     return;
   }
-  // if the command line does not end with & then return
-  if (cmd_line[idx] != '&') {
+  size_t size = sizeof(char*) * (args_len + 1) + strlen(exec) + 1;
+  for (int i = 0; i < args_len; ++i) {
+    size += strlen(args[i]) + 1;
+  }
+  block = malloc(size);
+  if (!block) {
+    perror("smash error: malloc failed");
     return;
   }
-  // replace the & (background sign) with space and then remove all tailing spaces.
-  cmd_line[idx] = ' ';
+  char** new_args = static_cast<char**>(block);
+  char* pos = reinterpret_cast<char*>(new_args + args_len + 1);
+  for (int i = 0; i < args_len; ++i) {
+    size_t len = strlen(args[i]) + 1;
+    new_args[i] = static_cast<char*>(memcpy(pos, args[i], len));
+    pos += len;
+  }
+  new_args[args_len] = NULL;
+  exec = static_cast<char*>(memcpy(pos, exec, strlen(exec) + 1));
+  args = new_args;
+}
+
+/* JobsList + jobs command start */
 
-  // truncate the command line string up to the last non-space character
-  cmd_line[str.find_last_not_of(WHITESPACE, idx) + 1] = 0;
+void JobsList::insert(JobEntry* job) {
+  if (table.size() <= (size_t)job->jobId) {
+    table.resize(job->jobId + 1, nullptr);
+  }
+  table[job->jobId] = job;
+  if (job->members.empty() && !job->isQueued()) {
+    by_pid[job->pid] = job->jobId;
+  }
+  for (pid_t pid : job->members) {
+    by_pid[pid] = job->jobId;
+  }
+  if (job->isStopped) {
+    stopped.insert(job->jobId);
+  }
+  count++;
 }
 
+void JobsList::erase(JobEntry* job) {
+  table[job->jobId] = nullptr;
+  while (!table.empty() && table.back() == nullptr) { // Keep the last job at the back.
+    table.pop_back();
+  }
+  by_pid.erase(job->pid);
+  for (pid_t pid : job->members) {
+    by_pid.erase(pid);
+  }
+  stopped.erase(job->jobId);
+  count--;
+}
 
-Command::Command(const char* line, char** args, int args_len, char* exec) : 
-  cmd_line(string(line)), args(args), args_len(args_len), exec(exec) {
+int pidfdOpen(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0); // Close-on-exec by default.
+}
+
+int signalProcess(pid_t pid, int pidfd, int sig) {
+  if (pidfd != -1) {
+    int res = syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+    if (res == 0 || errno != ENOSYS) {
+      return res; // ESRCH here means it's gone, even if its pid was taken since.
+    }
   }
+  return kill(pid, sig);
+}
 
-void Command::cleanup() {
-  for (int i = 0; i < args_len; ++i) {
-    if (args[i]) free(args[i]);
+JobsList::JobEntry::~JobEntry() {
+  closePidfd();
+  if (out_fd != -1) {
+    close(out_fd);
   }
-  if (args) free(args);
-  if (exec) free(exec);
+  delete parallel;
+  delete cmd;
 }
 
-/* JobsList + jobs command start */
+void JobsList::JobEntry::closePidfd() {
+  if (pidfd != -1) {
+    SmallShell::getInstance().unwatchPid(pid);
+    close(pidfd);
+    pidfd = -1;
+  }
+}
+
+void JobsList::setStopped(JobEntry* job, bool isStopped) {
+  job->isStopped = isStopped;
+  if (isStopped) {
+    stopped.insert(job->jobId);
+  } else {
+    stopped.erase(job->jobId);
+  }
+}
+
+static pid_t _launchCommand(Command* cmd, Launcher& launcher);
+
+int JobsList::running() const {
+  return count - queue.size() - stopped.size();
+}
+
+void JobsList::queueJob(Command* cmd, int out_fd, Command* timeout, int timeout_ms) {
+  removeFinishedJobs();
+  cmd->compact();
+  int newId = table.empty() ? 1 : table.size();
+  JobEntry* job = new JobEntry(cmd, -1, false, newId);
+  job->out_fd = out_fd;
+  job->timeout = timeout;
+  job->timeout_ms = timeout_ms;
+  if (timeout) {
+    timeout->compact(); // Outlives its line too.
+  }
+  insert(job);
+  queue.push_back(newId);
+}
+
+bool JobsList::startJob(JobEntry* job) {
+  queue.erase(std::find(queue.begin(), queue.end(), job->jobId));
+  SmallShell& smash = SmallShell::getInstance();
+  Launcher launcher;
+  launcher.setProcessGroup(0);
+  if (job->out_fd != -1) {
+    launcher.redirect(job->out_fd, STDOUT_FILENO);
+  } else if (smash.getStdout() != -1) { // Started while another command's output is redirected, not ours.
+    launcher.redirect(smash.getStdout(), STDOUT_FILENO);
+  }
+  pid_t pid = _launchCommand(job->cmd, launcher);
+  if (pid == -1) {
+    erase(job);
+    delete job;
+    return false;
+  }
+  if (job->out_fd != -1) {
+    close(job->out_fd);
+    job->out_fd = -1;
+  }
+  job->pid = pid;
+  job->elapsed = time(NULL); // Its time counts from when it started.
+  by_pid[pid] = job->jobId;
+  job->pidfd = smash.watchPid(pid);
+  if (job->timeout) {
+    smash.addTimeout(job->timeout, pid, job->timeout_ms); // The timeout counts from the start as well.
+  }
+  return true;
+}
+
+void JobsList::cancelJob(JobEntry* job) {
+  queue.erase(std::find(queue.begin(), queue.end(), job->jobId));
+  erase(job);
+  delete job;
+}
+
+void JobsList::schedule() {
+  if (scheduling || !reaping) { // Once is enough. And a forked copy of the shell doesn't start its parent's jobs.
+    return;
+  }
+  scheduling = true;
+  while (!queue.empty() && !isFull()) {
+    startJob(table[queue.front()]);
+  }
+  scheduling = false;
+}
 
 void JobsList::addJob(Command* cmd, pid_t pid, bool isStopped) {
   removeFinishedJobs(); 
-  int newId = jobs.empty() ? 1 : jobs.back()->jobId + 1;
-  JobEntry* newJob = new JobEntry(cmd, pid, isStopped, newId);
-  jobs.push_back(newJob);
+  cmd->compact();
+  int newId = table.empty() ? 1 : table.size();
+  JobEntry* job = new JobEntry(cmd, pid, isStopped, newId);
+  job->pidfd = SmallShell::getInstance().watchPid(pid);
+  insert(job);
+  int status;
+  if (takeStatus(pid, &status)) { // It changed state before it became a job.
+    applyStatus(job, pid, status);
+  }
+}
+
+void JobUsage::add(const struct rusage& usage) {
+  user += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  sys += usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  max_rss = std::max(max_rss, usage.ru_maxrss);
+  voluntary += usage.ru_nvcsw;
+  involuntary += usage.ru_nivcsw;
+  read_bytes += usage.ru_inblock * 512LL; // In 512 byte blocks.
+  write_bytes += usage.ru_oublock * 512LL;
+}
+
+void JobUsage::add(const JobUsage& usage) {
+  user += usage.user;
+  sys += usage.sys;
+  max_rss = std::max(max_rss, usage.max_rss);
+  voluntary += usage.voluntary;
+  involuntary += usage.involuntary;
+  read_bytes += usage.read_bytes;
+  write_bytes += usage.write_bytes;
+}
+
+static ssize_t _readProc(pid_t pid, const char* name, char* buffer, size_t size) {
+  /* One read is enough for these files, the kernel makes them whole in one go. */
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t num = read(fd, buffer, size - 1);
+  close(fd);
+  if (num >= 0) {
+    buffer[num] = '\0';
+  }
+  return num;
+}
+
+static long long _procField(const char* text, const char* name) { // The number after "\nname:", 0 if there's none.
+  const char* found = strstr(text, name);
+  return found ? atoll(found + strlen(name)) : 0;
 }
 
-void JobsList::printJobsList() {
+bool JobUsage::read(pid_t pid) {
+  char buffer[4096];
+  if (_readProc(pid, "stat", buffer, sizeof(buffer)) <= 0) {
+    return false;
+  }
+  const char* fields = strrchr(buffer, ')'); // The name before it may have spaces and parentheses in it.
+  unsigned long utime, stime;
+  long cutime, cstime;
+  if (!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+                        &utime, &stime, &cutime, &cstime) != 4) {
+    return false;
+  }
+  static const double ticks = sysconf(_SC_CLK_TCK);
+  user += (utime + cutime) / ticks;
+  sys += (stime + cstime) / ticks;
+  if (_readProc(pid, "status", buffer, sizeof(buffer)) > 0) {
+    max_rss = std::max(max_rss, (long)_procField(buffer, "\nVmHWM:"));
+    voluntary += _procField(buffer, "\nvoluntary_ctxt_switches:");
+    involuntary += _procField(buffer, "\nnonvoluntary_ctxt_switches:");
+  }
+  if (_readProc(pid, "io", buffer, sizeof(buffer)) > 0) { // Not there without task accounting in the kernel.
+    read_bytes += _procField(buffer, "\nread_bytes:");
+    write_bytes += _procField(buffer, "\nwrite_bytes:");
+  }
+  return true;
+}
+
+static void _printUsage(const JobEntry* job) {
+  JobUsage usage = job->reaped;
+  if (job->members.empty()) {
+    usage.read(job->pid);
+  }
+  for (pid_t pid : job->members) {
+    usage.read(pid);
+  }
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(2) << "    cpu " << usage.user << "s user " << usage.sys << "s sys, max rss "
+       << usage.max_rss << " KB, context switches " << usage.voluntary << " voluntary " << usage.involuntary
+       << " involuntary, io " << usage.read_bytes / 1024 << " KB read " << usage.write_bytes / 1024 << " KB written";
+  std::cout << line.str() << std::endl;
+}
+
+void JobsList::printJobsList(bool verbose) {
   removeFinishedJobs();
   time_t now = time(NULL);
   if (now == -1) { //might fail according to man.
     perror("smash error: time failed");
   }
-  for(JobEntry* job : jobs) {
+  for(JobEntry* job : table) {
+    if (!job) continue;
+    if (job->isQueued()) {
+      std::cout << "[" << job->jobId << "] " << job->cmd->getCmdLine() << " : " << difftime(now, job->elapsed) << " secs (queued)" << std::endl;
+      continue;
+    }
     std::cout << "[" << job->jobId << "] " << job->cmd->getCmdLine() << " : " << 
       job->pid << " " << difftime(now, job->elapsed) << " secs";
+    ParallelCommand* parallel = job->parallel ? job->parallel : dynamic_cast<ParallelCommand*>(job->cmd);
+    unsigned done, total;
+    if (parallel && parallel->getProgress(&done, &total)) {
+      std::cout << " (" << done << "/" << total << " done)";
+    }
     if (job->isStopped) {
       std::cout << " (stopped)";
     }
     std::cout << std::endl;
+    if (verbose) {
+      _printUsage(job);
+    }
   }
 }
 
 void JobsList::killAllJobs() {
-    cout << "smash: sending SIGKILL signal to " << jobs.size() << " jobs:" << endl;
-    for (JobEntry* job : jobs) {
-      if (kill(job->pid, SIGKILL) == -1) {
+    cout << "smash: sending SIGKILL signal to " << count - queue.size() << " jobs:" << endl;
+    for (JobEntry* job : table) {
+      if (!job || job->isQueued()) continue; // Never started, they just go with the list.
+      if (job->sendSignal(SIGKILL) == -1) {
         perror("smash error: kill failed");
       } else {
       cout << job->pid << ": " << job->cmd->getCmdLine() << endl;
@@ -147,71 +418,133 @@ void JobsList::killAllJobs() {
     } 
 }
 
+bool JobsList::applyStatus(JobEntry* job, pid_t pid, int status, const struct rusage* usage) {
+  if (WIFEXITED(status) || WIFSIGNALED(status)) { // remove finished process. (WIFSIGNALED means killed by sigkill)
+    if (!job->members.empty()) { // A stage of a pipe, which is done when the last one is.
+      job->members.erase(std::find(job->members.begin(), job->members.end(), pid));
+      by_pid.erase(pid);
+      if (pid == job->pid) { // The leader's pidfd is all we watch, and it would stay readable until the pipe is done.
+        job->closePidfd();
+      }
+      if (usage) {
+        job->reaped.add(*usage);
+      }
+      if (!job->members.empty()) {
+        return false;
+      }
+    }
+    SmallShell::getInstance().removeTimeout(job->pid);
+    erase(job);
+    delete job;
+    schedule(); // Its slot is free.
+    return true;
+  } else if (WIFSTOPPED(status)) {
+    setStopped(job, true);
+    schedule();
+  } else if (WIFCONTINUED(status)) {
+    setStopped(job, false);
+  }
+  return false;
+}
+
 void JobsList::removeFinishedJobs() {
+  if (!reaping || !changed) {
+    return;
+  }
+  changed = 0; // Before draining, so a SIGCHLD that comes meanwhile makes us look again next time.
+  int status;
+  struct rusage usage;
   pid_t w;
- 
-  auto current = jobs.begin();
-  while (current != jobs.end())
-  {
-      int status;
-      w = waitpid((*current)->pid, &status, WNOHANG | WUNTRACED | WCONTINUED); //WNOHANG = don't block, check immediately the status of pid.
-      if (w == -1) {
-        perror("smash error: waitpid failed");
-        ++current;
-      } else if ((WIFEXITED(status) || WIFSIGNALED(status)) && w > 0) { // remove finished process. (WIFSIGNALED means killed by sigkill)
-        SmallShell::getInstance().removeTimeout((*current)->pid);
-        delete *current;
-        current = jobs.erase(current);  // "erase" returns an iterator, pointing to the next element in the list (after the erased one)
-      } else if (WIFSTOPPED(status) && w > 0) {
-        addStopMark((*current)->jobId);
-        ++current;
-      } else if (WIFCONTINUED(status) && w > 0) {
-        removeStopMark((*current)->jobId);
-        ++current;
-      } else {
-        ++current;
-      }
+  while ((w = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) { //WNOHANG = don't block.
+    if (!updateJob(w, status, &usage)) {
+      unclaimed[w] = status; // The latest status is the one that counts.
+    }
+  }
+  if (w == -1 && errno != ECHILD) {
+    perror("smash error: waitpid failed");
+  }
+}
+
+bool JobsList::updateJob(pid_t pid, int status, const struct rusage* usage) {
+  /* A child's state changed and we already reaped the status. */
+  auto found = by_pid.find(pid);
+  if (found == by_pid.end()) {
+    return false;
+  }
+  applyStatus(table[found->second], pid, status, usage);
+  return true;
+}
+
+void JobsList::stopReaping() {
+  reaping = false;
+  for (JobEntry* job : table) {
+    if (job && job->pidfd != -1) {
+      close(job->pidfd);
+      job->pidfd = -1;
+    }
+  }
+}
+
+void JobsList::reapPid(pid_t pid) {
+  int status;
+  struct rusage usage;
+  pid_t w = wait4(pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+  if (w > 0 && (WIFEXITED(status) || WIFSIGNALED(status))) { // Its pidfd would wake us up forever.
+    SmallShell::getInstance().unwatchPid(w);
+  }
+  if (w > 0 && !updateJob(w, status, &usage)) {
+    unclaimed[w] = status; // A job that's in the foreground right now, its waiter takes it from here.
+  }
+}
+
+bool JobsList::takeStatus(pid_t pid, int* status) {
+  auto found = unclaimed.find(pid);
+  if (found == unclaimed.end()) {
+    return false;
   }
+  *status = found->second;
+  unclaimed.erase(found);
+  return true;
 }
 
 JobEntry * JobsList::getJobById(int jobId) const {
-  for (auto current = jobs.begin(); current != jobs.end(); ++current) {
-    if ((*current)->jobId == jobId) return *current;
+  if (jobId <= 0 || (size_t)jobId >= table.size()) {
+    return nullptr;
+  }
+  return table[jobId];
+}
+
+std::vector<JobEntry*> JobsList::getJobsInRange(int first, int last) const {
+  std::vector<JobEntry*> jobs;
+  for (int id = std::max(first, 1); id <= last && id < (int)table.size(); id++) {
+    if (table[id]) jobs.push_back(table[id]);
   }
-  return nullptr;
+  return jobs;
 }
 
 void JobsList::removeJobById(int jobId) {
-  for (auto current = jobs.begin(); current != jobs.end(); ++current) {
-    if ((*current)->jobId == jobId) {
-      jobs.erase(current);
-      return;
-    }
+  JobEntry* job = getJobById(jobId);
+  if (job) {
+    erase(job);
   }
 }
 
 JobEntry* JobsList::getLastJob(int *lastJobId) const {
-  if (jobs.empty()) {
+  if (table.empty()) {
     *lastJobId = -1;
     return nullptr;
   }
-  *lastJobId = jobs.back()->jobId;
-  return jobs.back();
+  *lastJobId = table.back()->jobId;
+  return table.back();
 }
 
 JobEntry* JobsList::getLastStoppedJob(int* jobId) const {
-  if (jobs.empty()) {
+  if (stopped.empty()) {
     *jobId = -1;
     return nullptr;
   }
-  for (auto current = jobs.rbegin(); current != jobs.rend(); ++current) { //Using reverse iterator because we want the last stopped.
-    if ((*current)->isStopped) {
-      *jobId = (*current)->jobId;
-      return *current;
-    }
-  }
-  *jobId = -1;
-  return nullptr;
+  *jobId = *stopped.rbegin();
+  return table[*jobId];
 }
 
 int JobsList::checkIfStopped(int jobId, bool* res) const {
@@ -228,7 +561,7 @@ int JobsList::removeStopMark(int jobId) {
   if (!job) {
     return -1;
   }
-  job->isStopped = false;
+  setStopped(job, false);
   return 0;
 }
 int JobsList::addStopMark(int jobId) {
@@ -236,39 +569,43 @@ int JobsList::addStopMark(int jobId) {
   if (!job) {
     return -1;
   }
-  job->isStopped = true;
+  setStopped(job, true);
   return 0;
 }
 
 
 int JobsList::addExistingJob(JobEntry* job) {
   /* Recieved a job to insert (i.e, job that was taken out from the jobs list and now wants back).
-  We should add it in the right place w.r.t jobId. */
-  if (jobs.empty() || jobs.back()->jobId < job->jobId) {
-    /* The idea is that if the list is empty, so the job inserted should inserted first.
-    Otherwise, we check if the last job in the list (which, according to our invaraiant, has the maximal id) has 
-    a smaller jobId than the job inserted*/
-    jobs.push_back(job);
-    return 0;
-  } else { // else, we will insert in the middle of the list
-    for (auto it = jobs.begin(); it != jobs.end(); ++it) {
-      if ((*it)->jobId > job->jobId) {
-        jobs.insert(it, job); // "insert" inserts just *before* the iterator (first argument) given.
-        return 0;
-      }
+  It goes back to its own slot, its jobId didn't change. A pipe that was never a job gets a new id. */
+  if (job->jobId <= 0) {
+    removeFinishedJobs();
+    job->jobId = table.empty() ? 1 : table.size();
+  } else if (getJobById(job->jobId)) {
+    return -1; //Something went wrong (shouldn't happen, if our code works well).
+  }
+  bool leading = job->members.empty() || std::find(job->members.begin(), job->members.end(), job->pid) != job->members.end();
+  if (job->pidfd == -1 && leading) { // Once the leader is reaped its pid may be someone else's.
+    job->pidfd = SmallShell::getInstance().watchPid(job->pid);
+  }
+  insert(job);
+  std::vector<pid_t> pids = job->members.empty() ? std::vector<pid_t>{job->pid} : job->members;
+  for (pid_t pid : pids) { // Stages that changed state before they became (again) a job.
+    int status;
+    if (takeStatus(pid, &status) && applyStatus(job, pid, status)) {
+      break;
     }
   }
-  return -1; //Something went wrong (shouldn't reach here, if our code works well).
+  return 0;
 }
 
 JobsList::~JobsList() {
-  for(JobEntry* job : jobs) {
+  for(JobEntry* job : table) {
     delete job;
   }
 }
 
 void JobsCommand::execute() {
-  jobs->printJobsList(); 
+  jobs->printJobsList(args_len >= 2 && strcmp(args[1], "-v") == 0); 
 }
 
 /* Jobs command end */
@@ -276,11 +613,13 @@ void JobsCommand::execute() {
 static void handleForeground(Command* cmd, pid_t pid) { 
   /*Helper function to handle foreground *processes*, that didn't run in the background before.*/
   SmallShell& smash = SmallShell::getInstance();
-  smash.setForegroundProcess(pid);
+  int pidfd = pidfdOpen(pid); // For ctrl-C and ctrl-Z. Jobs have their own.
+  smash.setForegroundProcess(pid, pidfd);
   int status;
-  int w = waitpid(pid, &status, WUNTRACED); // WUNTRACED = also return if a child has stopped. needed for ctrl+z.
+  int w = smash.waitChild(pid, &status); // Also returns if the child has stopped. needed for ctrl+z.
+  smash.setForegroundProcess(-1);
+  if (pidfd != -1) close(pidfd);
   if (w == -1) {
-    smash.setForegroundProcess(-1);
     perror("smash error: waitpid failed");
     return;
   }
@@ -288,76 +627,88 @@ static void handleForeground(Command* cmd, pid_t pid) {
     //Fg process was stopped. add to jobs list.
     smash.addJob(cmd, pid, true); // true means: add stopped mark.
   }
-  else if (WIFEXITED(status)) {
+  else { //Done, or killed.
     smash.removeTimeout(pid);
     delete cmd; 
   }
-  smash.setForegroundProcess(-1); //No process is running in the foreground now.
+}
+
+static void handleGroupForeground(JobEntry* job) {
+  /* A pipe in the foreground, until all its stages are done or it's stopped. Stages that are done leave job->members. */
+  SmallShell& smash = SmallShell::getInstance();
+  smash.setForegroundGroup(job);
+  bool stopped = false;
+  while (!job->members.empty() && !stopped) {
+    int status;
+    pid_t w = -1;
+    for (pid_t pid : job->members) { // The reaper may have got some statuses first.
+      if (smash.getJobs()->takeStatus(pid, &status) && !WIFCONTINUED(status)) {
+        w = pid;
+        break;
+      }
+    }
+    struct rusage usage = {};
+    if (w == -1) {
+      w = wait4(-job->pgid, &status, WUNTRACED | WNOHANG, &usage); // Only the stages of this pipe.
+    }
+    if (w == 0) {
+      smash.waitForEvents(false); // Until SIGCHLD, handling signals and timeouts meanwhile.
+      continue;
+    }
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      perror("smash error: waitpid failed");
+      break;
+    }
+    if (WIFSTOPPED(status)) {
+      //A stage was stopped, so is the whole pipe. ctrl-Z stopped all of them, the others are stopped here.
+      job->sendSignal(SIGSTOP);
+      stopped = true;
+    } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      job->members.erase(std::find(job->members.begin(), job->members.end(), w));
+      job->reaped.add(usage);
+      if (w == job->pid) {
+        job->closePidfd();
+      }
+    }
+  }
+  smash.setForegroundGroup(nullptr); //Ended/stopped now.
+  if (stopped) {
+    smash.addJob(job, true); // Back in the jobs list (or in it for the first time), stopped.
+  } else {
+    smash.removeTimeout(job->pid);
+    delete job;
+  }
 }
 
 static void handleForeground(JobEntry* job) {
   /* Used for fg command, where we want to foregroung a process that is currently stopped, or runs in the background.
   That means that we have already allocated a JobEntry for it, and it already has a unique JobId that should not be changed.
   So we have to use the same JobEntry which was already created, and add it again to the list using addExistingJob. */
+  if (job->pgid != -1) {
+    handleGroupForeground(job);
+    return;
+  }
   int status;
   SmallShell& smash = SmallShell::getInstance();
-  smash.setForegroundProcess(job->pid);
-  pid_t w = waitpid(job->pid, &status, WUNTRACED);
+  smash.setForegroundProcess(job->pid, job->pidfd);
+  pid_t w = smash.waitChild(job->pid, &status);
   if (w == -1) {
     smash.setForegroundProcess(-1);
     perror("smash error: waitpid failed");
+    delete job;
     return;
   }
   if (WIFSTOPPED(status)) {
     //job was stopped (CTRL+Z)
     smash.addJob(job, true); // true = process is stopped.
-  } else if (WIFEXITED(status)) {
-    //job was killed (Ctrl+C)
+  } else { //Done, or killed (Ctrl+C, a timeout...).
     smash.removeTimeout(job->pid);
     delete job;
   }
   smash.setForegroundProcess(-1);
 }
 
-static void handleForeground(Command* cmd1, Command* cmd2, pid_t p1, pid_t p2) {
-  /* Used for pipe command. */
-  int status;
-  SmallShell& smash = SmallShell::getInstance();
-  smash.setForegroundProcess(p1); 
-  smash.setPipedForegroundProcess(p2);
-  pid_t w = waitpid(p1, &status, WUNTRACED); 
-  if (w == -1) {
-    smash.setForegroundProcess(-1); 
-    smash.setPipedForegroundProcess(-1);
-    perror("smash error: waitpid failed");
-    return;
-  } 
-  if (WIFSTOPPED(status)) {
-    //Fg process was stopped. add to jobs list.
-    smash.addJob(cmd1, p1, true); // true means: add stopped mark.
-  }
-  else if (WIFEXITED(status)) {
-    delete cmd1; 
-  }
-  smash.setForegroundProcess(-1); //Ended/stopped now.
-  w = waitpid(p2, &status, WUNTRACED);
-  if (w == -1) {
-    smash.setForegroundProcess(-1); 
-    smash.setPipedForegroundProcess(-1);
-    perror("smash error: waitpid failed");
-    return;
-  }
-  if (WIFSTOPPED(status)) {
-    //Fg process was stopped. add to jobs list.
-    smash.addJob(cmd2, p2, true); // true means: add stopped mark.
-  }
-  else if (WIFEXITED(status)) {
-    delete cmd2; 
-  }
-  smash.setForegroundProcess(-1); 
-  smash.setPipedForegroundProcess(-1);
-}
-
 /* fg commang start */
 void ForegroundCommand::execute() {
   JobEntry* job;
@@ -385,9 +736,11 @@ void ForegroundCommand::execute() {
     }
   }
   //Now job is actually a JobEntry* and jobId is its id.
+  if (job->isQueued() && !jobs->startJob(job)) { // Its turn is now, room or not.
+    return;
+  }
   std::cout << job->cmd->getCmdLine() << " : " << job->pid << std::endl;
-  pid_t pid = job->pid; 
-  if (kill(pid, SIGCONT) == -1) {
+  if (job->sendSignal(SIGCONT) == -1) {
     perror("smash error: kill failed");
     return;
   }
@@ -422,6 +775,12 @@ void BackgroundCommand::execute() {
       std::cout << "smash error: bg: job-id " << jobId << " does not exist" << std::endl;
       return;
     }
+    if (job->isQueued()) { // Starts it ahead of its turn.
+      if (jobs->startJob(job)) {
+        std::cout << job->cmd->getCmdLine() << " : " << job->pid << std::endl;
+      }
+      return;
+    }
     bool res;
     jobs->checkIfStopped(jobId, & res);
     if (!res) {
@@ -430,8 +789,7 @@ void BackgroundCommand::execute() {
     }
   }
   std::cout << job->cmd->getCmdLine() << " : " << job->pid << std::endl;
-  pid_t pid = job->pid;
-  if (kill(pid, SIGCONT) == -1) {
+  if (job->sendSignal(SIGCONT) == -1) {
     perror("smash error: kill failed");
     return;
   }
@@ -448,176 +806,178 @@ void ChangePromptCommand::execute() {
 
 /* ExternalCommand start */
 void ExternalCommand::execute() { 
+  SmallShell& smash = SmallShell::getInstance();
+  int duration;
+  Command* timeout;
+  bool timed = smash.isTimedout(&duration, &timeout);
+  if (bg && smash.getJobs()->isFull()) { // Too many running already, it waits for its turn.
+    int out_fd = -1;
+    if (smash.getStdout() != -1 && (out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) == -1) {
+      perror("smash error: fcntl failed");
+      return;
+    }
+    smash.getJobs()->queueJob(this, out_fd, timed ? timeout : nullptr, duration);
+    return;
+  }
+  Launcher launcher;
+  launcher.setProcessGroup(0);
+  pid_t pid = _launchCommand(this, launcher);
+  if (pid == -1) {
+    return;
+  }
+  if (timed) {
+    smash.addTimeout(timeout, pid, duration);
+  }
+  int stdout_fd = smash.getStdout(); //For redirection...
+  if (stdout_fd != -1) { 
+    dup2(stdout_fd, STDOUT_FILENO); //If stdout was overriden, return it.
+  }
+  if (bg) { //background command, don't wait, add to jobsList.
+    smash.addJob(this, pid);
+  } else { //foreground command, wait, change shell's state.
+    handleForeground(this, pid);
+  }
+}
+/* ExternalCommand end */
+
+/* Pipe command start */
+PipeCommand::PipeCommand(const char *cmd_line, char** args, int args_len, char* exec, bool bg, vector<Stage>&& stages) : 
+  Command(cmd_line, args, args_len, exec), bg(bg), stages(std::move(stages)) {}
+
+PipeCommand::~PipeCommand() {
+  for (Stage& stage : stages) {
+    delete stage.command;
+  }
+}
+
+static pid_t _forkBuiltin(Command* cmd, pid_t pgid, int in_fd, int out_fd, int target_fd, const vector<int>& fds) {
+  /* Built-in stages run in a forked copy of the shell (like bash runs pipe stages in subshells), concurrently with
+  the rest of the pipe. Running them in the shell itself would block it as soon as they write more than the pipe holds.
+  posix_spawn can't run our own code, so this is the one place that still forks. */
+  if (_actsOnShell(cmd)) {
+    std::cout << "smash error: " << cmd->getArgs()[0] << ": cannot run in a pipe" << std::endl;
+    return -1;
+  }
+  std::cout.flush(); // Or the child would print whatever is still buffered a second time.
   pid_t pid = fork();
   if (pid < 0) {
     perror("smash error: fork failed");
-    return;
-  }
-  else if (pid == 0) { //child
-    setpgrp();
-    const char* const bash_args[] = {"/bin/bash", "-c", exec, nullptr};
-    EXEC("/bin/bash", bash_args); 
+    return -1;
   }
-  else {
-    //parent
-    SmallShell& smash = SmallShell::getInstance();
-    int duration;
-    Command* timeout;
-    if (smash.isTimedout(&duration, &timeout)) {
-      smash.addTimeout(timeout, pid, duration);
+  if (pid == 0) { //child
+    SmallShell::getInstance().enterSubshell();
+    setpgid(0, pgid);
+    if (in_fd != -1) {
+      dup2(in_fd, STDIN_FILENO);
     }
-    int stdout_fd = smash.getStdout(); //For redirection...
-    if (stdout_fd != -1) { 
-      dup2(stdout_fd, STDOUT_FILENO); //If stdout was overriden, return it.
+    if (out_fd != -1) {
+      dup2(out_fd, target_fd);
     }
-    if (bg) { //background command, don't wait, add to jobsList.
-      smash.addJob(this, pid);
-    } else { //foreground command, wait, change shell's state.
-      handleForeground(this, pid);
+    for (int fd : fds) { // fork keeps close-on-exec descriptors, and the readers would never see EOF.
+      close(fd);
     }
+    cmd->execute();
+    std::cout.flush();
+    _exit(0);
   }
+  setpgid(pid, pgid == 0 ? pid : pgid); // Also here, so the next stage can't look for the group before the child joined it.
+  return pid;
 }
-/* ExternalCommand end */
-
-/* Pipe command start */
-PipeCommand::PipeCommand(const char *cmd_line, char** args, int args_len, char* exec, bool bg) : 
-  Command(cmd_line, args, args_len, exec), bg(bg) {}
 
 void PipeCommand::execute() {
-  string cmd1, cmd2, cmd_str = exec; //exec has no background sign &
-  size_t index = cmd_str.find_first_of("|");
-  cmd1 = cmd_str.substr(0,index);
-  bool err_flag = cmd_str.find_first_of("&") != string::npos;
-  // check if we have & operator
-  if(err_flag && cmd_str.find_first_of("&") == index+1){
-      cmd2 = cmd_str.substr(index + 2);
-  } else {
-      err_flag = false; // The & is for background, because it is not right after |.
-      cmd2 = cmd_str.substr(index + 1);
-  }
-  cmd2 = _trim(cmd2);
-  cmd1 =_trim(cmd1);
-  // get all the vars before we start to fork the proc
   SmallShell &my_shell = SmallShell::getInstance();
-  if (bg) {
-    cmd1.append("&");
-    cmd2.append("&");
-  }
-  //Create commands.
-  Command *command1 = my_shell.CreateCommand(cmd1.c_str());
-  Command *command2 = my_shell.CreateCommand(cmd2.c_str());
-  bool isCmd1Builtin = dynamic_cast<BuiltInCommand *>(command1) != nullptr;
-  if (dynamic_cast<BuiltInCommand *>(command2) != nullptr) {// the command is built-in.
-      command2->execute();
-      delete command1;
-      delete command2;
-      return;
-      /// need to check if we should handle the jobs here
-  }
-  pid_t p1, p2;
-  // create 2 post array for file descriptors
-  int fileD[2]; 
-  if (pipe(fileD) == -1) {
-    perror("smash error: pipe failed");
-  }
-  int stdIn = dup(STDIN_FILENO), stdOut = dup(STDOUT_FILENO), stdErr = dup(STDERR_FILENO);
-  int to_close = err_flag ? STDERR_FILENO : STDOUT_FILENO; //Depends on | or |&
-  int old_out_fd = err_flag ? stdErr : stdOut; //Relevant standard stream file-object.
-
-  /* write side */
-  close(to_close); //Closes stderr or stdout.
-  dup(fileD[1]); // Copies write-side of the pipe to err/out.
-
-  if(isCmd1Builtin) {// the command is built-in.
-      command1->execute();
-  }
-  else { // we need to use an external command - fork
-      p1 = fork();
-      if (p1 < 0) {
-        close(fileD[0]);
-        close(fileD[1]);
-        dup2(stdIn, 0);
-        dup2(old_out_fd, to_close);
-        close(stdOut);
-        close(stdIn);
-        close(stdErr);
-        perror("smash error: fork failed");
-        return;
+  size_t n = stages.size();
+  //From here on the commands belong to the jobs list, or are deleted below.
+  vector<Command*> commands(n);
+  for (size_t i = 0; i < n; ++i) {
+    commands[i] = stages[i].command;
+    stages[i].command = nullptr;
+  }
+  // pipe i connects stage i to stage i + 1: fds[2 * i] is its read side, fds[2 * i + 1] its write side.
+  // They are close-on-exec, each stage only keeps the copies dup2'ed to its stdin/stdout.
+  vector<int> fds(2 * (n - 1), -1);
+  for (size_t i = 0; i + 1 < n; ++i) {
+    if (pipe2(&fds[2 * i], O_CLOEXEC) == -1) {
+      perror("smash error: pipe failed");
+      for (int fd : fds) {
+        if (fd != -1) close(fd);
       }
-      if (p1 == 0) { // first child, writes to the pipe.
-        setpgrp();
-        close(fileD[0]); // close the read side of the pipe
-        /// now we need to exec the cmd1 and let it write to the pipe
-        // Should check if redirection and pipes are possible.
-        const char * const bash_args[] = {"/bin/bash", "-c", const_cast<char *>(command1->getExec()), nullptr};
-        EXEC("/bin/bash", bash_args);
+      for (Command* command : commands) {
+        delete command;
       }
+      return;
+    }
+    if (my_shell.getPipeSize() > 0 && fcntl(fds[2 * i + 1], F_SETPIPE_SZ, my_shell.getPipeSize()) == -1) {
+      perror("smash error: fcntl failed"); // Not fatal, the pipe keeps its default size.
+    }
   }
 
-  /* read side */
-  dup2(stdOut, STDOUT_FILENO); // Change 1 back to the stdout we started with.
-  dup2(stdErr, STDERR_FILENO);
-  p2 = fork();
-  if (p2 < 0) {
-    close(fileD[0]);
-    close(fileD[1]);
-    dup2(stdIn, 0);
-    dup2(old_out_fd, to_close);
-    close(stdOut);
-    close(stdIn);
-    close(stdErr);
-    perror("smash error: fork failed");
-    return;
-  }
-  else if (p2 == 0) { // second child - reads from the pipe - change std in cmd2 - we dont use here builtIn Commands
-    setpgrp();
-    dup2(fileD[0], 0); // set the read side of the pipe as the stdin
-    close(fileD[1]); // close the write side of the pipe
-    // external command
-    // no need to touch signal handlers, as execv will reset them for the child.
-    const char * const bash_args[] = {"/bin/bash", "-c", const_cast<char *>(command2->getExec()), nullptr};
-    EXEC("/bin/bash", bash_args);
+  vector<pid_t> pids(n, -1);
+  pid_t pgid = 0; // The first stage leads a new process group, the rest join it.
+  for (size_t i = 0; i < n; ++i) {
+    int out_target = stages[i].pipe_stderr ? STDERR_FILENO : STDOUT_FILENO; //Depends on | or |&
+    if (dynamic_cast<BuiltInCommand *>(commands[i]) != nullptr) {
+      pids[i] = _forkBuiltin(commands[i], pgid, i > 0 ? fds[2 * (i - 1)] : -1, i + 1 < n ? fds[2 * i + 1] : -1, out_target, fds);
+    } else {
+      Launcher launcher;
+      launcher.setProcessGroup(pgid);
+      if (i > 0) {
+        launcher.redirect(fds[2 * (i - 1)], STDIN_FILENO); // read side of the previous pipe is the stdin
+      }
+      if (i + 1 < n) {
+        launcher.redirect(fds[2 * i + 1], out_target);
+      }
+      pids[i] = _launchCommand(commands[i], launcher);
+    }
+    if (pgid == 0 && pids[i] != -1) {
+      pgid = pids[i];
+    }
   }
   /* back to the smash proc */
-  close(fileD[0]);
-  close(fileD[1]);
-
-  dup2(stdIn, 0);
-  dup2(old_out_fd, to_close);
-  /* SmallShell process continued */
-  
-  if (bg) { //pipe runs in background. treat it as two seperate jobs.
-    if (!isCmd1Builtin) {
-      my_shell.addJob(command1, p1);
-    }
-    my_shell.addJob(command2, p2);
-  } else {
-    if (isCmd1Builtin) {// the first command is built in
-      handleForeground(command2, p2);
+  for (int fd : fds) {
+    close(fd);
+  }
+  /* The pipe is one job, shown by the command of its first stage with the whole line.
+  The other commands aren't needed anymore, their processes (or forked copies) have them,
+  except a parallel, whose progress jobs shows. */
+  JobEntry* job = nullptr;
+  ParallelCommand* parallel = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    if (pids[i] != -1 && !job) {
+      commands[i]->setCmdLine(cmd_line);
+      commands[i]->compact();
+      job = new JobEntry(commands[i], pids[i], false, 0);
+      job->pgid = pgid;
+    } else if (pids[i] != -1 && !parallel && (parallel = dynamic_cast<ParallelCommand*>(commands[i]))) {
+      parallel->compact();
     } else {
-      handleForeground(command1, command2, p1, p2);
+      delete commands[i];
     }
+    if (pids[i] != -1) {
+      job->members.push_back(pids[i]);
+    }
+  }
+  if (!job) { // Nothing started.
+    return;
+  }
+  job->parallel = parallel;
+  if (bg) {
+    my_shell.addJob(job);
+  } else {
+    handleGroupForeground(job);
   }
-  close(stdOut);
-  close(stdIn);
-  close(stdErr);
 }
 
 /* Pipe command end */
 
 /* Redirection command start */
-RedirectionCommand::RedirectionCommand(const char *cmd_line, char **args, int args_len, char *exec, bool bg) : 
-  Command(cmd_line, args, args_len, exec), bg(bg) {}
+RedirectionCommand::RedirectionCommand(const char *cmd_line, char **args, int args_len, char *exec, bool bg,
+                                       Command* command, const char* path, bool append) : 
+  Command(cmd_line, args, args_len, exec), path(path), bg(bg), command(command), append(append) {}
 
 void RedirectionCommand::execute() {
     SmallShell& myShell = SmallShell::getInstance();
-    string cmd_str = string(exec), cmd_1, cmd_2;
-    int f_index = cmd_str.find_first_of(">");
-    int s_index = cmd_str.find_last_of(">");
-
-    cmd_1 = cmd_str.substr(0, f_index); // the command that we need te exec
-    cmd_2 = cmd_str.substr(s_index + 1); // the destination of the output
-    cmd_2 = _trim(cmd_2); //clear spaces from filename
+    string cmd_2 = path; // the destination of the output
     if(cmd_2 == "") {
         return;
     }
@@ -666,7 +1026,7 @@ void RedirectionCommand::execute() {
     }
 
     int fd;
-    if (f_index == s_index) { // we have ">" and we need to overwrite
+    if (!append) { // we have ">" and we need to overwrite
       fd = open(cmd_2.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
     }
     else { // we have ">>" ane we need to append to the file
@@ -678,15 +1038,26 @@ void RedirectionCommand::execute() {
       perror("smash error: open failed");
       return;
     }
-    if (bg) {
-      cmd_1.append("&"); // Make sure the command created is backgrounded.
-    }
-    
-    Command* command = myShell.CreateCommand(cmd_1.c_str());
+    Command* command = this->command; //Runs now, and then belongs to the jobs list or is deleted.
+    this->command = nullptr;
     command->setCmdLine(getCmdLine()); //Change command to be printed to the form: command > filename, instead of command.
     myShell.setStdout(stdout_fd);
     //Don't fork built-in commands, as we wish to get a good grade :)
+    bool transient = _isTransient(command);
+    UringSink* sink = nullptr;
+    std::streambuf* old_buf = nullptr;
+    if (dynamic_cast<BuiltInCommand*>(command)) { // Writes right from here, through cout. See UringSink.
+      sink = new UringSink(STDOUT_FILENO);
+      old_buf = std::cout.rdbuf(sink);
+    }
     command->execute(); //So much simpler now...
+    if (sink) {
+      std::cout.rdbuf(old_buf);
+      delete sink; // Waits for its writes, before fd is closed.
+    }
+    if (transient) {
+      delete command;
+    }
     myShell.setStdout(-1);
     close(fd); //fd should be 1.
     dup2(stdout_fd, STDOUT_FILENO); 
@@ -695,109 +1066,43 @@ void RedirectionCommand::execute() {
 /* Redirection command end */
 
 /* copy command start */
-void makeCopy(int f_source, int f_destination) {
-  std::vector<char> buffer(1024);
-  int num, wrote;
-  while (true) {
-    num = read(f_source, buffer.data(), buffer.size());
-    if (num == 0) break;
-
-    auto write_amount = 0;
-    auto need_to_write = num;
-    while (write_amount < need_to_write) {
-      wrote = write(f_destination, buffer.data() + write_amount, num - write_amount);
-      if (wrote < 0) {
-          perror("smash error: write failed");
-          close(f_destination);
-          close(f_source);
-          return;
-      }
-      write_amount += wrote;
-    }
-  }
-  close(f_destination);
-  close(f_source);
-}
-
-//Helper functions to check if two descriptors refer to the exact same place in hard-disk.
-bool same_file(int fd1, int fd2) {
-  struct stat stat1, stat2;
-  if (fstat(fd1, &stat1) < 0) {
-    perror("smash error: fstat failed");
-    return false;
-  }
-  if (fstat(fd2, &stat2) < 0) {
-    perror("smash error: fstat failed");
-    return false;
-  }
-  return (stat1.st_dev == stat2.st_dev) && (stat1.st_ino == stat2.st_ino);
-}
-
 CopyCommand::CopyCommand(const char *cmd_line, char **args, int args_len, char *exec, bool bg) :
         Command(cmd_line, args, args_len, exec), bg(bg) {}
 
 void CopyCommand::execute() {
-  if (args_len != 3) {
+  if (args_len < 3) {
       std::cout << "smash error: cp: invalid arguments" << endl;
       return;
   }
-  string source, destination;
-  source = args[1];
-  destination = args[2];
-  int f_source = open(source.c_str(), O_RDONLY);
-  if (f_source == -1) {
-    perror("smash error: open failed");
-    return;
-  }
-  int f_destination = open(destination.c_str(), O_WRONLY | O_CREAT, 0666);
-  if (f_destination == -1) {
-    close(f_source);
-    perror("smash error: open failed");
-    return;
-  }
-  if (!same_file(f_source, f_destination)) {
-    /*If the files are exactly the same, close the old descriptor and open it again without O_TRUNC,
-    as we don't want to delete a filed being copied, while already exists. */
-    close(f_destination);
-    f_destination = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (f_destination == -1) {
-      close(f_source);
-      perror("smash error: open failed");
-      return;
-    }
-  }
   SmallShell &myShell = SmallShell::getInstance();
 
-  pid_t pid = fork();
-  if (pid == 0) { //child proc
-    setpgrp();
-    signal(SIGINT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
-    makeCopy(f_source, f_destination);
-    std::cout << "smash: " << source << " was copied to " << destination << endl;
-    exit(0);
-  } else if (pid < 0) {
-    close(f_destination);
-    close(f_source);
-    perror("smash error: fork failed");
+  /* The copy itself runs in a fresh smash process started in helper mode (see copyHelperMain),
+  so it can be spawned like any external command, and it's one job however many files it copies.
+  The helper gets cp's arguments as they are and does all the checking and opening itself. */
+  vector<char*> helper_args = {const_cast<char*>("smash"), const_cast<char*>(COPY_HELPER_FLAG)};
+  helper_args.insert(helper_args.end(), args + 1, args + args_len);
+  helper_args.push_back(nullptr);
+  Launcher launcher;
+  launcher.setProcessGroup(0);
+  pid_t pid = launcher.spawn("/proc/self/exe", helper_args.data());
+  if (pid == -1) {
+    perror("smash error: posix_spawn failed");
     return;
-  } else { // parent
-    close(f_destination);
-    close(f_source);
-    if (bg) { // background func
-      myShell.addJob(this, pid);
-    }
-    else { // foreground func
-      handleForeground(this, pid);
-    }
+  }
+  if (bg) { // background func
+    myShell.addJob(this, pid);
+  }
+  else { // foreground func
+    handleForeground(this, pid);
   }
 }
+
 /*copy command end */
 
 /* showpid start */
 void ShowPidCommand::execute() {
-  //no need to check for errors, according to man getpid() is always successful.
-  cout << "smash pid is " << getpid() << endl;
+  //the shell's pid, even when we run as a stage of a pipe in a forked copy of it.
+  cout << "smash pid is " << SmallShell::getInstance().getPid() << endl;
 }
 
 /* showpid end */
@@ -861,6 +1166,77 @@ void GetCurrDirCommand::execute() {
   free(path); // getcwd allocate memory for the path we need to free it
 }
 
+/* parallel command start */
+
+ParallelCommand::ParallelCommand(const char *cmd_line, char **args, int args_len, char *exec, bool bg) :
+        Command(cmd_line, args, args_len, exec), bg(bg) {}
+
+ParallelCommand::~ParallelCommand() {
+  if (progress) {
+    munmap(progress, sizeof(ParallelProgress));
+  }
+}
+
+pid_t ParallelCommand::spawn(Launcher& launcher) {
+  /* Like cp, the work is done by a fresh smash in helper mode (see parallelHelperMain), which starts the items
+  in its own process group, so the whole parallel is stopped, continued or killed like one process.
+  It counts what it did in a memfd we map as well, for jobs. */
+  int progress_fd = memfd_create("smash-parallel", MFD_CLOEXEC);
+  if (progress_fd != -1 && ftruncate(progress_fd, sizeof(ParallelProgress)) == 0) {
+    void* shared = mmap(nullptr, sizeof(ParallelProgress), PROT_READ | PROT_WRITE, MAP_SHARED, progress_fd, 0);
+    progress = shared == MAP_FAILED ? nullptr : static_cast<ParallelProgress*>(shared); // Zeroed by ftruncate.
+  }
+  vector<char*> helper_args = {const_cast<char*>("smash"), const_cast<char*>(PARALLEL_HELPER_FLAG)};
+  if (progress) {
+    helper_args.push_back(const_cast<char*>("--progress"));
+    launcher.redirect(progress_fd, PARALLEL_PROGRESS_FD);
+  }
+  helper_args.insert(helper_args.end(), args + 1, args + args_len);
+  helper_args.push_back(nullptr);
+  pid_t pid = launcher.spawn("/proc/self/exe", helper_args.data());
+  if (progress_fd != -1) {
+    close(progress_fd);
+  }
+  if (pid == -1) {
+    perror("smash error: posix_spawn failed");
+  }
+  return pid;
+}
+
+bool ParallelCommand::getProgress(unsigned* done, unsigned* total) const {
+  if (!progress) {
+    return false;
+  }
+  *total = progress->total.load(std::memory_order_relaxed);
+  *done = progress->done.load(std::memory_order_relaxed);
+  return *total > 0;
+}
+
+void ParallelCommand::execute() {
+  if (args_len < 2) {
+      std::cout << "smash error: parallel: invalid arguments" << endl;
+      return;
+  }
+  Launcher launcher;
+  launcher.setProcessGroup(0);
+  pid_t pid = spawn(launcher);
+  if (pid == -1) {
+    return;
+  }
+  //One job for the helper and its items, signalled through their process group like a pipe.
+  JobEntry* job = new JobEntry(this, pid, false, 0);
+  job->pgid = pid;
+  job->members.push_back(pid);
+  compact();
+  if (bg) {
+    SmallShell::getInstance().addJob(job);
+  } else {
+    handleGroupForeground(job);
+  }
+}
+
+/* parallel command end */
+
 /* ls command start */
 void LsDirectoryCommand::execute() {
   char *cwd = getcwd(NULL, 0);
@@ -885,31 +1261,99 @@ void LsDirectoryCommand::execute() {
 /* ls command end */
 
 /*kill command start */
+static bool _sendToJob(JobsList* jobs, JobEntry* job, int sigNum) {
+  if (job->isQueued()) { // Nothing to signal yet. Killing it takes it off the queue.
+    if (sigNum != SIGKILL && sigNum != SIGTERM) {
+      std::cout << "smash error: kill: job-id " << job->jobId << " is queued" << std::endl;
+      return false;
+    }
+    std::cout << "smash: job-id " << job->jobId << " was removed from the queue" << std::endl;
+    jobs->cancelJob(job);
+    return true;
+  }
+  if (job->sendSignal(sigNum) == -1) {
+    perror("smash error: kill failed");
+    return false;
+  }
+  std::cout << "signal number " << sigNum << " was sent to pid " << job->pid << std::endl;
+  return true;
+}
+
 void KillCommand::execute() {
   if (args_len != 3) {
     cout << "smash error: kill: invalid arguments" << endl;
     return;
   }
-  if (!std::regex_match(args[1], std::regex("[(-|+)][0-9]+")) || !std::regex_match(args[2], std::regex("[(-|+)]?[0-9]+"))) {
+  std::cmatch range;
+  bool many = strcmp(args[2], "all") == 0 || std::regex_match(args[2], range, std::regex("%?([0-9]+)-%?([0-9]+)"));
+  if (!std::regex_match(args[1], std::regex("[(-|+)][0-9]+")) ||
+      (!many && !std::regex_match(args[2], std::regex("%?[(-|+)]?[0-9]+")))) {
       cout << "smash error: kill: invalid arguments" << endl;
       return;
   }
-  int jobId = stoi(args[2]), sigNum = stoi(args[1]);
+  int sigNum = abs(stoi(args[1]));
+  if (many) { // kill -SIG all, kill -SIG %first-%last
+    int first = 1, last = INT_MAX;
+    if (!range.empty()) {
+      first = atoi(range[1].str().c_str());
+      last = atoi(range[2].str().c_str());
+    }
+    std::vector<JobEntry*> targets = job_list->getJobsInRange(first, last);
+    if (targets.empty()) {
+      cout << "smash error: kill: " << (range.empty() ? "jobs list is empty" : "no jobs in range " + string(args[2])) << endl;
+      return;
+    }
+    for (JobEntry* job : targets) {
+      _sendToJob(job_list, job, sigNum);
+    }
+    return;
+  }
+  int jobId = stoi(args[2][0] == '%' ? args[2] + 1 : args[2]);
 
   JobEntry *thisJob = job_list->getJobById(jobId);
   if (!thisJob) {
       cout << "smash error: kill: job-id " << jobId << " does not exist" << endl;
       return;
   }
-  sigNum = abs(sigNum);
-  if (kill(thisJob->pid, sigNum) == -1) {
-      perror("smash error: kill failed");
-      return;
-  }
-  std::cout << "signal number " << sigNum << " was sent to pid " << thisJob->pid << std::endl;
+  _sendToJob(job_list, thisJob, sigNum);
 }
 /* kill command end*/
 
+/* launchstats command start */
+
+void LaunchStatsCommand::execute() {
+  int total, direct;
+  SmallShell::getInstance().getLaunchStats(&total, &direct);
+  cout << "smash: " << direct << " of " << total << " launches used direct exec" << endl;
+}
+
+/* launchstats command end */
+
+/* hash command start */
+
+void HashCommand::execute() {
+  if (args_len > 2 || (args_len == 2 && strcmp(args[1], "-r") != 0)) {
+    cout << "smash error: hash: invalid arguments" << endl;
+    return;
+  }
+  if (args_len == 2) { // hash -r
+    path_cache->reset();
+    return;
+  }
+  const auto& entries = path_cache->getEntries();
+  if (entries.empty()) {
+    cout << "smash: hash: hash table empty" << endl;
+  } else {
+    cout << "hits\tcommand" << endl;
+    for (const auto& entry : entries) {
+      cout << std::setw(4) << entry.second.hits << "\t" << entry.second.path << endl;
+    }
+  }
+  cout << "smash: hash: " << path_cache->getHits() << " hits, " << path_cache->getMisses() << " misses" << endl;
+}
+
+/* hash command end */
+
 /* quit command start */
 
 void QuitCommand::execute() {
@@ -923,99 +1367,158 @@ void QuitCommand::execute() {
 
 /* timeout command start */
 
+TimeoutList::TimeoutEntry::TimeoutEntry(Command* cmd, pid_t pid, int duration_ms) : cmd(cmd), pid(pid), index(0) {
+  deadline = TimeoutList::now() + duration_ms;
+}
+
 TimeoutList::~TimeoutList() {
-  for (ToEntry* to : timeouts) {
+  for (ToEntry* to : heap) {
     delete to;
   }
+  if (timer_fd != -1) {
+    close(timer_fd);
+  }
 }
 
-int TimeoutList::findMinTimeout() const {
-  if (timeouts.empty()) return 0;
-  int min = timeouts.front()->timeToLive();
-  for (ToEntry* to : timeouts) {
-    int left = to->timeToLive();
-    if (left < min) {
-      min = left;
+long long TimeoutList::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int TimeoutList::getTimerFd() {
+  if (timer_fd == -1) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+      perror("smash error: timerfd_create failed");
     }
   }
-  return min;
+  return timer_fd;
 }
 
-void TimeoutList::removeByPid(pid_t pid) {
-  auto current = timeouts.begin();
-  while (current != timeouts.end()) {
-    if ((*current)->pid == pid) { //Time to kill.
-      delete *current;
-      current = timeouts.erase(current);
-      return;
-    } else {
-      ++current;
+void TimeoutList::place(ToEntry* to, size_t index) {
+  heap[index] = to;
+  to->index = index;
+}
+
+void TimeoutList::siftUp(size_t index) {
+  ToEntry* to = heap[index];
+  while (index > 0 && heap[(index - 1) / 2]->deadline > to->deadline) {
+    place(heap[(index - 1) / 2], index);
+    index = (index - 1) / 2;
+  }
+  place(to, index);
+}
+
+void TimeoutList::siftDown(size_t index) {
+  ToEntry* to = heap[index];
+  while (true) {
+    size_t child = 2 * index + 1;
+    if (child >= heap.size()) break;
+    if (child + 1 < heap.size() && heap[child + 1]->deadline < heap[child]->deadline) {
+      child++;
     }
-  } 
+    if (heap[child]->deadline >= to->deadline) break;
+    place(heap[child], index);
+    index = child;
+  }
+  place(to, index);
 }
 
-void TimeoutList::addTimeout(Command* cmd, pid_t pid, int duration) {
-  ToEntry* to = new ToEntry(cmd, pid, duration);
-  timeouts.push_back(to);
+void TimeoutList::removeAt(size_t index) {
+  by_pid.erase(heap[index]->pid);
+  ToEntry* last = heap.back();
+  heap.pop_back();
+  if (index < heap.size()) { // Fill the hole with the last one and let it find its place.
+    place(last, index);
+    siftDown(index);
+    siftUp(last->index);
+  }
+}
+
+void TimeoutList::arm() {
+  int fd = getTimerFd();
+  if (fd == -1) {
+    return;
+  }
+  struct itimerspec when = {};
+  if (!heap.empty()) { // Otherwise all zeros disarms it.
+    long long deadline = std::max(heap.front()->deadline, 1LL); // 0 would disarm.
+    when.it_value.tv_sec = deadline / 1000;
+    when.it_value.tv_nsec = (deadline % 1000) * 1000000;
+  }
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &when, nullptr) == -1) {
+    perror("smash error: timerfd_settime failed");
+  }
+}
+
+void TimeoutList::removeByPid(pid_t pid) {
+  auto found = by_pid.find(pid);
+  if (found == by_pid.end()) {
+    return;
+  }
+  ToEntry* to = found->second;
+  bool first = to->index == 0;
+  removeAt(to->index);
+  delete to;
+  if (first) {
+    arm();
+  }
+}
+
+void TimeoutList::addTimeout(Command* cmd, pid_t pid, int duration_ms) {
+  cmd->compact();
+  ToEntry* to = new ToEntry(cmd, pid, duration_ms);
+  by_pid[pid] = to;
+  heap.push_back(to);
+  siftUp(heap.size() - 1);
+  if (to->index == 0) { // The new earliest deadline.
+    arm();
+  }
 }
 
 void TimeoutList::handleAlarms() {
-  SmallShell::getInstance().removeJobs();
-  auto current = timeouts.begin();
-  while (current != timeouts.end()) {
-    time_t now = time(NULL);
-    if (now == -1) {
-      perror("smash error: time failed");
-      return;
-    }
-    if (difftime(now, (*current)->timestamp) >= (*current)->duration) { //Time to kill.
-      if (kill((*current)->pid, SIGKILL) == -1) {
-        perror("smash error: kill failed");
-      } else {
-        std::cout << "smash: " << (*current)->cmd->getCmdLine() << " timed out!" << std::endl;
-      }
-      delete *current;
-      current = timeouts.erase(current);
+  uint64_t expirations;
+  if (timer_fd != -1 && read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+    perror("smash error: read failed");
+  }
+  long long current = now();
+  while (!heap.empty() && heap.front()->deadline <= current) {
+    ToEntry* to = heap.front();
+    removeAt(0);
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, to->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid != 0) {
+      /* It's done and just wasn't reaped yet (WNOWAIT leaves that to the reaper), so it didn't time out.
+      Or it was reaped already (ECHILD), and its pid may belong to someone else by now. */
+    } else if (kill(to->pid, SIGKILL) == -1) { //Time to kill.
+      perror("smash error: kill failed");
     } else {
-      ++current;
+      std::cout << "smash: " << to->cmd->getCmdLine() << " timed out!" << std::endl;
     }
+    delete to;
   }
-  int next_timeout = findMinTimeout();
-  if (next_timeout > 0) {
-    alarm(next_timeout);
-  }
+  arm();
 }
 
 void TimeoutCommand::execute() {
   SmallShell& smash = SmallShell::getInstance();
-  string timeout_cmd_str = cmd_line;
-  if (!args[1] || !args[2]) {
+  if (!args[1] || !command) {
     //Invalid command. it is not mentioned in the hw what to do in this case, but at least avoid bugs...
     std::cout << "smash error: timeout: invalid arguments" << std::endl;
     return;
   }
-  string dur = args[1]; 
-  size_t index = timeout_cmd_str.find(dur);
-  index += dur.size(); 
-  string cmd = timeout_cmd_str.substr(index); // cmd to execute.
-  cmd = _trim(cmd);
-  int duration;
-  try {
-    duration = stoi(dur);
-  } catch (invalid_argument& i) {
-    std::cout << "smash error: timeout: invalid arguments" << std::endl;
-    return;
-  } 
-  if (duration <= 0) {
+  //Seconds, with a fraction if you like (timeout 0.25 ...). We keep milliseconds.
+  char* end;
+  double seconds = strtod(args[1], &end);
+  if (end == args[1] || *end != '\0' || !(seconds > 0) || seconds > INT_MAX / 1000) {
     std::cout << "smash error: timeout: invalid arguments" << std::endl;
     return;
   }
-  time_t before = timeouts->findMinTimeout();
-  if (before == 0 || (before > 0 && duration < before)) {
-    alarm(duration);
-  }
+  int duration = std::max(1, (int)std::ceil(seconds * 1000));
 
-  Command* command = smash.CreateCommand(cmd.c_str());
+  Command* command = this->command; //Runs now, and then belongs to the jobs list or is deleted.
+  this->command = nullptr;
   command->setCmdLine(getCmdLine()); //Do we need to print "timeout X Y" in jobs list or just the "Y"? Who knows...?
   if (dynamic_cast<BuiltInCommand*>(command) != nullptr) {
     // What to do in a timeout <> <built-in>? for now just ignore it and execute regularly.
@@ -1025,13 +1528,213 @@ void TimeoutCommand::execute() {
   }
   /* Good case: external command! (What about pipes, redirection...?) */
   smash.setTimeout(this, duration);
+  bool transient = _isTransient(command);
   command->execute();
+  if (transient) {
+    delete command;
+  }
   smash.setTimeout(nullptr, -1);
 }
 
 /* SmallShell start */
 SmallShell::SmallShell() {
   old_pwd = nullptr;
+  pid = getpid(); //no need to check for errors, according to man getpid() is always successful.
+  const char* pipe_size_env = getenv("SMASH_PIPE_SIZE"); // Capacity of the pipes between stages, in bytes.
+  if (pipe_size_env) {
+    pipe_size = atoi(pipe_size_env);
+  }
+  const char* max_jobs_env = getenv("SMASH_MAX_JOBS"); // Background jobs running at once, 0 for no limit.
+  long max_jobs = max_jobs_env ? atol(max_jobs_env) : sysconf(_SC_NPROCESSORS_ONLN);
+  jobs.setMaxRunning(max_jobs > 0 ? max_jobs : 0);
+}
+
+/* What an epoll event is about goes in the upper half of its data, the pid (for pidfds) in the lower. */
+enum EventKind { EVENT_INPUT = 1, EVENT_SIGNAL, EVENT_TIMER, EVENT_PIDFD };
+
+static uint64_t _eventData(EventKind kind, pid_t pid = 0) {
+  return ((uint64_t)kind << 32) | (uint32_t)pid;
+}
+
+static sigset_t _shellSignals() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTSTP);
+  sigaddset(&set, SIGCHLD);
+  sigaddset(&set, SIGALRM);
+  return set;
+}
+
+void SmallShell::initEvents() {
+  //Every job holds a pidfd, so thousands of jobs need more descriptors than the usual soft limit.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("smash error: epoll_create1 failed");
+    return;
+  }
+  sigset_t set = _shellSignals();
+  /* The signals stay blocked in the shell and wait in the signalfd. Spawned children start with an
+  empty mask (see Launcher), and forked ones unblock them in enterSubshell. */
+  signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd == -1 || sigprocmask(SIG_BLOCK, &set, nullptr) == -1) {
+    perror("smash error: signalfd failed");
+  } else {
+    struct epoll_event event = {EPOLLIN, {.u64 = _eventData(EVENT_SIGNAL)}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+  }
+  int timer_fd = timeouts.getTimerFd();
+  if (timer_fd != -1) {
+    struct epoll_event event = {EPOLLIN, {.u64 = _eventData(EVENT_TIMER)}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+  }
+  /* Only in the loop while readLine waits for a line: even without events epoll reports a hangup,
+  and a pipe at its end would wake every foreground wait at once. Added here to see if epoll can watch it. */
+  struct epoll_event event = {EPOLLIN, {.u64 = _eventData(EVENT_INPUT)}};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
+    input_pollable = false;
+  } else {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, nullptr);
+  }
+}
+
+void SmallShell::enterSubshell() {
+  jobs.stopReaping();
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+  if (signal_fd != -1) {
+    close(signal_fd);
+    signal_fd = -1;
+  }
+  sigset_t set = _shellSignals();
+  sigprocmask(SIG_UNBLOCK, &set, nullptr);
+}
+
+void SmallShell::unwatchPid(pid_t pid) {
+  auto found = watched.find(pid);
+  if (found == watched.end()) {
+    return;
+  }
+  if (epoll_fd != -1) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, found->second, nullptr);
+  }
+  watched.erase(found);
+}
+
+int SmallShell::watchPid(pid_t pid) {
+  if (epoll_fd == -1) {
+    return -1;
+  }
+  int pidfd = pidfdOpen(pid);
+  if (pidfd == -1) {
+    return -1; // An old kernel. SIGCHLD still tells us about it.
+  }
+  struct epoll_event event = {EPOLLIN, {.u64 = _eventData(EVENT_PIDFD, pid)}};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+    perror("smash error: epoll_ctl failed");
+    close(pidfd);
+    return -1;
+  }
+  watched[pid] = pidfd;
+  return pidfd;
+}
+
+bool SmallShell::waitForEvents(bool input, bool block) {
+  if (epoll_fd == -1) { // No event loop, stdin is all we can block on.
+    if (!input && block) usleep(1000);
+    return input;
+  }
+  bool wait = block && (!input || input_pollable); // A regular file is always ready, just handle what's pending.
+  if (block && input_pollable && input != input_watched) { // A pass that doesn't block can leave stdin as it is.
+    struct epoll_event event = {EPOLLIN, {.u64 = _eventData(EVENT_INPUT)}};
+    epoll_ctl(epoll_fd, input ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &event);
+    input_watched = input;
+  }
+  struct epoll_event events[32];
+  int count = epoll_wait(epoll_fd, events, 32, wait ? -1 : 0);
+  if (count == -1) {
+    if (errno != EINTR) {
+      perror("smash error: epoll_wait failed");
+    }
+    return false;
+  }
+  bool ready = input && !input_pollable;
+  bool alarmed = false;
+  for (int i = 0; i < count; i++) {
+    uint64_t data = events[i].data.u64;
+    switch (data >> 32) {
+      case EVENT_INPUT:
+        ready = input;
+        break;
+      case EVENT_TIMER:
+        alarmed = true;
+        break;
+      case EVENT_PIDFD:
+        jobs.reapPid((pid_t)(uint32_t)data);
+        break;
+      case EVENT_SIGNAL:
+        alarmed = drainSignals() || alarmed;
+        break;
+    }
+  }
+  if (alarmed) {
+    alarmHandler(SIGALRM);
+  }
+  return ready;
+}
+
+bool SmallShell::drainSignals() {
+  bool alarmed = false;
+  struct signalfd_siginfo info;
+  while (signal_fd != -1 && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    switch (info.ssi_signo) {
+      case SIGINT: ctrlCHandler(SIGINT); break;
+      case SIGTSTP: ctrlZHandler(SIGTSTP); break;
+      case SIGCHLD: childHandler(SIGCHLD); break;
+      case SIGALRM: alarmed = true; break;
+    }
+  }
+  return alarmed;
+}
+
+bool SmallShell::readLine(std::string& line) {
+  /* Reads stdin ourselves rather than with getline, so we can sleep on it and on the timer
+  at the same time, and handle a timeout while waiting for the user. */
+  while (true) {
+    size_t newline = input.find('\n');
+    if (newline != string::npos) {
+      /* Already read, so we don't wait in the loop for it. What came meanwhile must still be handled
+      before the line runs: SIGCHLDs and pidfds, or jobs, fg and kill would act on children that are gone,
+      and the timer, or an expired timeout would go on running. */
+      waitForEvents(false, false);
+      line.assign(input, 0, newline);
+      input.erase(0, newline + 1);
+      return true;
+    }
+    if (!waitForEvents(true)) {
+      continue;
+    }
+    char buffer[4096];
+    ssize_t num = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (num == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      perror("smash error: read failed");
+      return false;
+    }
+    if (num == 0) { // End of input, the last line may have no newline.
+      line.swap(input);
+      input.clear();
+      return !line.empty();
+    }
+    input.append(buffer, num);
+  }
 }
 
 SmallShell::~SmallShell() {}
@@ -1049,8 +1752,9 @@ void SmallShell::addJob(JobEntry* job, bool isStopped) {
   jobs.addExistingJob(job);
 }
 
-void SmallShell::setForegroundProcess(pid_t fg) {
+void SmallShell::setForegroundProcess(pid_t fg, int pidfd) {
   fg_pid = fg;
+  fg_pidfd = pidfd;
 }
 
 pid_t SmallShell::getForegroundPid() const {
@@ -1073,85 +1777,278 @@ string SmallShell::getPromptName() {
   return prompt_name;
 }
 
+void SmallShell::countLaunch(bool direct) {
+  ++launches;
+  if (direct) {
+    ++direct_launches;
+  }
+}
+
+void SmallShell::getLaunchStats(int* total, int* direct) const {
+  *total = launches;
+  *direct = direct_launches;
+}
+
 void SmallShell::handleAlarms() {
+  cout << "smash: got an alarm" << endl;
   timeouts.handleAlarms();
 }
 
-/**
-* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
-*/
-Command * SmallShell::CreateCommand(const char* cmd_line) {
-  bool background = false;
-  if (_isBackgroundComamnd(cmd_line)) {
-    background = true;
-  }
-  if (string(cmd_line).find_first_not_of(WHITESPACE) == string::npos) return nullptr;
-  // remove bg sign...
-  char** args = (char**)malloc(sizeof(char*) * (COMMAND_MAX_ARGS + 1));
-  char* cmd_to_execute = (char*)malloc(strlen(cmd_line) + 1);
-  strcpy(cmd_to_execute, cmd_line);
-  _removeBackgroundSign(cmd_to_execute);
-  int args_len = _parseCommandLine(cmd_to_execute, args);
-  if (args_len <= 0) { // empty command (just pressed enter)
-    return nullptr;
+pid_t SmallShell::waitChild(pid_t pid, int* status) {
+  //The reaper may have got its status first. Continuing isn't what a foreground wait waits for.
+  while (true) {
+    while (jobs.takeStatus(pid, status)) {
+      if (!WIFCONTINUED(*status)) {
+        return pid;
+      }
+    }
+    pid_t w = waitpid(pid, status, WUNTRACED | WNOHANG);
+    if (w != 0) {
+      return w;
+    }
+    waitForEvents(false); // Until SIGCHLD or its pidfd, handling signals and timeouts meanwhile.
   }
-  // first check for pipes / i-o redirection commands ...
-  string cmd_str = string(cmd_line);
-  if (strcmp(args[0], "timeout") == 0) { //Give timeout top priority. Important.
-    return new TimeoutCommand(cmd_line, args, args_len, cmd_to_execute, &timeouts, background);
-  } 
-  if(cmd_str.find_first_of(">") != string::npos) { //redirection
-    return new RedirectionCommand(cmd_line, args, args_len, cmd_to_execute, background);
+}
+
+/* Command registry start */
+
+/* Builtins (and the commands that need special handling, like cp and timeout) are looked up through a
+perfect hash table that is generated at compile time from COMMANDS below.
+To add a command, add a line to COMMANDS - the static_assert makes sure the table is still collision free. */
+
+constexpr uint32_t _hashName(const char* name, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed; // FNV-1a
+  for (; *name; ++name) {
+    hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619u;
   }
-  else if (cmd_str.find_first_of("|") != string::npos) { //pipe
-    return new PipeCommand(cmd_line, args, args_len, cmd_to_execute, background);
+  hash ^= hash >> 15; // FNV's low bits only depend on the low bits of the seed, mix the high ones in.
+  hash *= 0x2c1b3c6du;
+  return hash ^ (hash >> 12);
+}
+
+constexpr bool _sameName(const char* a, const char* b) {
+  for (; *a && *a == *b; ++a, ++b) {}
+  return *a == *b;
+}
+
+struct CommandRegistration {
+  const char* name;
+  SmallShell::CommandFactory factory;
+};
+
+constexpr CommandRegistration COMMANDS[] = {
+  {"chprompt", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new ChangePromptCommand(cmd_line, args, args_len, exec);
+  }},
+  {"ls", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool bg) -> Command* {
+    if (args[1] != NULL) { // Our ls takes no arguments, let the real one handle it.
+      return new ExternalCommand(cmd_line, args, args_len, exec, bg);
+    }
+    return new LsDirectoryCommand(cmd_line, args, args_len, exec);
+  }},
+  {"showpid", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new ShowPidCommand(cmd_line, args, args_len, exec);
+  }},
+  {"pwd", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new GetCurrDirCommand(cmd_line, args, args_len, exec);
+  }},
+  {"cp", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool bg) -> Command* {
+    return new CopyCommand(cmd_line, args, args_len, exec, bg);
+  }},
+  {"parallel", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool bg) -> Command* {
+    return new ParallelCommand(cmd_line, args, args_len, exec, bg);
+  }},
+  {"cd", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new ChangeDirCommand(cmd_line, args, args_len, exec, smash.getOldPwd());
+  }},
+  {"kill", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new KillCommand(cmd_line, args, args_len, exec, smash.getJobs());
+  }},
+  {"jobs", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new JobsCommand(cmd_line, args, args_len, exec, smash.getJobs());
+  }},
+  {"fg", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new ForegroundCommand(cmd_line, args, args_len, exec, smash.getJobs());
+  }},
+  {"bg", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new BackgroundCommand(cmd_line, args, args_len, exec, smash.getJobs());
+  }},
+  {"launchstats", [](SmallShell&, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new LaunchStatsCommand(cmd_line, args, args_len, exec);
+  }},
+  {"hash", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new HashCommand(cmd_line, args, args_len, exec, smash.getPathCache());
+  }},
+  {"quit", [](SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool) -> Command* {
+    return new QuitCommand(cmd_line, args, args_len, exec, smash.getJobs());
+  }},
+};
+
+constexpr std::size_t COMMANDS_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+constexpr std::size_t _tableSize(std::size_t n) { // Smallest power of two that is at least twice n.
+  std::size_t size = 1;
+  while (size < 2 * n) size <<= 1;
+  return size;
+}
+
+struct CommandTable {
+  static constexpr std::size_t SIZE = _tableSize(COMMANDS_COUNT);
+  uint32_t seed = 0;
+  int slots[SIZE] = {}; // index into COMMANDS, or -1 for an empty slot.
+  bool perfect = false;
+
+  constexpr CommandTable() {
+    for (uint32_t candidate = 0; candidate < 4096 && !perfect; ++candidate) { // Try seeds until nothing collides.
+      for (std::size_t i = 0; i < SIZE; ++i) slots[i] = -1;
+      perfect = true;
+      for (std::size_t i = 0; i < COMMANDS_COUNT && perfect; ++i) {
+        std::size_t slot = _hashName(COMMANDS[i].name, candidate) & (SIZE - 1);
+        if (slots[slot] != -1) {
+          perfect = false;
+        } else {
+          slots[slot] = i;
+        }
+      }
+      seed = candidate;
+    }
   }
-  else if (strcmp(args[0], "chprompt") == 0) {
-    return new ChangePromptCommand(cmd_line, args, args_len, cmd_to_execute);
+
+  constexpr const CommandRegistration* find(const char* name) const {
+    int index = slots[_hashName(name, seed) & (SIZE - 1)];
+    return (index != -1 && _sameName(COMMANDS[index].name, name)) ? &COMMANDS[index] : nullptr;
   }
-  else if (strcmp(args[0], "ls") == 0 && args[1] == NULL) {
-   return new LsDirectoryCommand(cmd_line, args, args_len,cmd_to_execute);
+};
+
+constexpr CommandTable COMMAND_TABLE;
+static_assert(COMMAND_TABLE.perfect, "no collision free seed for the command table, grow CommandTable::SIZE");
+
+SmallShell::CommandFactory SmallShell::findCommand(const char* name) {
+  const CommandRegistration* command = COMMAND_TABLE.find(name);
+  return command ? command->factory : nullptr;
+}
+
+/* Command registry end */
+
+char* SmallShell::copyText(std::string_view text) {
+  return line_arena.copy(text.data(), text.size());
+}
+
+int SmallShell::copyWords(size_t first, size_t count, char*** args_p) {
+  /* The values of the words (quotes removed), as a null terminated args array in the line arena. */
+  char** args = static_cast<char**>(line_arena.allocate(sizeof(char*) * (count + 1)));
+  for (size_t i = 0; i < count; ++i) {
+    const ParsedLine::Word& word = parsed.words[first + i];
+    args[i] = static_cast<char*>(line_arena.allocate(word.text.size() + 1, 1));
+    unquote(word, args[i]);
+  }
+  args[count] = NULL;
+  *args_p = args;
+  return count;
+}
+
+/* The build functions turn the parsed line into commands. skip drops words from the front of the first stage
+(the "timeout <duration>" prefix). cmd_line is what the command shows in the jobs list,
+nullptr means the command's own text. */
+
+Command* SmallShell::buildSimple(const char* cmd_line, const ParsedLine::Stage& stage, size_t skip) {
+  if (skip >= stage.count) {
+    return nullptr;
   }
-  else if (strcmp(args[0], "showpid") == 0) {
-    return new ShowPidCommand(cmd_line, args, args_len, cmd_to_execute);
+  char** args;
+  int args_len = copyWords(stage.first + skip, stage.count - skip, &args);
+  char* exec = copyText(parsed.textFrom(stage.first + skip, stage.text));
+  if (!cmd_line) {
+    cmd_line = exec;
   }
-  else if (strcmp(args[0], "pwd") == 0) {
-    return new GetCurrDirCommand(cmd_line, args, args_len, cmd_to_execute);
+  if (strcmp(args[0], "timeout") == 0) { // timeout inside a pipe.
+    Command* command = buildSimple(nullptr, stage, skip + 2);
+    return new TimeoutCommand(cmd_line, args, args_len, exec, &timeouts, parsed.background, command);
   }
-  else if (strcmp(args[0], "cp") == 0) {
-    return new CopyCommand(cmd_line, args, args_len, cmd_to_execute, background);
+  CommandFactory factory = findCommand(args[0]);
+  if (factory) {
+    return factory(*this, cmd_line, args, args_len, exec, parsed.background);
   }
-  else if (strcmp(args[0], "cd") == 0) {
-    return new ChangeDirCommand(cmd_line, args, args_len, cmd_to_execute, (char**)&this->old_pwd);
+  //External
+  return new ExternalCommand(cmd_line, args, args_len, exec, parsed.background);
+}
+
+Command* SmallShell::buildPipeline(const char* cmd_line, size_t skip) {
+  const ParsedLine::Stage& first = parsed.stages[0];
+  if (parsed.stages.size() == 1) {
+    return buildSimple(cmd_line, first, skip);
   }
-  else if (strcmp(args[0], "kill") == 0) {
-    return new KillCommand(cmd_line, args, args_len, cmd_to_execute, &jobs);
+  if (skip >= first.count) {
+    return nullptr;
   }
-  else if (strcmp(args[0], "jobs") == 0) {
-    return new JobsCommand(cmd_line, args, args_len, cmd_to_execute, &jobs); 
+  vector<PipeCommand::Stage> stages;
+  for (size_t i = 0; i < parsed.stages.size(); ++i) {
+    stages.push_back({buildSimple(nullptr, parsed.stages[i], i == 0 ? skip : 0), parsed.stages[i].pipe_stderr});
   }
-  else if (strcmp(args[0], "fg") == 0) {
-    return new ForegroundCommand(cmd_line, args, args_len, cmd_to_execute, &jobs); 
+  char** args;
+  int args_len = copyWords(first.first + skip, parsed.words.size() - first.first - skip, &args);
+  char* exec = copyText(parsed.textFrom(first.first + skip, parsed.stages.back().text));
+  return new PipeCommand(cmd_line ? cmd_line : exec, args, args_len, exec, parsed.background, std::move(stages));
+}
+
+Command* SmallShell::buildLine(const char* cmd_line, size_t skip) {
+  const ParsedLine::Stage& first = parsed.stages[0];
+  if (skip >= first.count) {
+    return nullptr;
   }
-  else if (strcmp(args[0], "bg") == 0) {
-    return new BackgroundCommand(cmd_line, args, args_len, cmd_to_execute, &jobs);
+  char** args;
+  int args_len;
+  char* exec;
+  if (parsed.words[first.first + skip].text == "timeout") { //Give timeout top priority, it wraps the whole line. Important.
+    Command* command = buildLine(nullptr, skip + 2);
+    args_len = copyWords(first.first + skip, parsed.words.size() - first.first - skip, &args);
+    exec = copyText(parsed.textFrom(first.first + skip, parsed.text));
+    return new TimeoutCommand(cmd_line ? cmd_line : exec, args, args_len, exec, &timeouts, parsed.background, command);
+  }
+  if (!parsed.redirect) {
+    return buildPipeline(cmd_line, skip);
+  }
+  //redirection, wraps the whole pipe (if there is one).
+  Command* command = buildPipeline(nullptr, skip);
+  if (!command) {
+    return nullptr;
   }
-  else if (strcmp(args[0], "quit") == 0) {
-    return new QuitCommand(cmd_line, args, args_len, cmd_to_execute, &jobs);
+  args_len = copyWords(first.first + skip, parsed.words.size() - first.first - skip, &args);
+  exec = copyText(parsed.textFrom(first.first + skip, parsed.text));
+  char* path = static_cast<char*>(line_arena.allocate(parsed.target.text.size() + 1, 1));
+  unquote(parsed.target, path);
+  return new RedirectionCommand(cmd_line ? cmd_line : exec, args, args_len, exec, parsed.background,
+                                command, path, parsed.append);
+}
+
+/**
+* Creates and returns a pointer to Command class which matches the given command line (cmd_line)
+*/
+Command * SmallShell::CreateCommand(const char* cmd_line) {
+  parseLine(cmd_line, parsed);
+  if (parsed.words.empty()) { // empty command (just pressed enter)
+    return nullptr;
   }
-  else { //External
-    return new ExternalCommand(cmd_line, args, args_len, cmd_to_execute, background);
+  if (!parsed.valid) { //Nothing we can represent, let bash make sense of it.
+    char** args;
+    int args_len = copyWords(0, parsed.words.size(), &args);
+    return new ExternalCommand(cmd_line, args, args_len, copyText(parsed.text), parsed.background);
   }
-  return nullptr;
+  return buildLine(cmd_line, 0);
 }
 
 void SmallShell::executeCommand(const char *cmd_line) {
+  line_arena.reset(); //Everything parsed for the previous line is gone, jobs hold compacted copies.
   jobs.removeFinishedJobs();
   Command* cmd = CreateCommand(cmd_line);
   if (!cmd) { //"Empty" command
     return;
   }
+  bool transient = _isTransient(cmd);
   cmd->execute();
+  if (transient) {
+    delete cmd;
+  }
 }
 
 /* SmallShell end */
\ No newline at end of file
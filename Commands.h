@@ -4,9 +4,18 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <set>
+#include <deque>
+#include <errno.h>
+#include <unordered_map>
+#include "arena.h"
+#include "parser.h"
+#include "pathcache.h"
 
 #define COMMAND_ARGS_MAX_LENGTH (200)
-#define COMMAND_MAX_ARGS (20)
 #define HISTORY_MAX_RECORDS (50)
 
 
@@ -16,17 +25,28 @@ protected:
     char** args;
     int args_len;
     char* exec;
+    void* block = nullptr; // Owns args and exec once they were moved out of the line arena.
  public:
   Command(const char* line, char** args, int args_len, char* exec);
   virtual ~Command() {cleanup();} 
   virtual void execute() = 0;
   virtual void cleanup();
+  void compact();
+  static void* operator new(std::size_t size) {
+    return poolAllocate(size);
+  }
+  static void operator delete(void* ptr, std::size_t size) {
+    poolFree(ptr, size);
+  }
   std::string getCmdLine() const {
     return cmd_line;
   }
   char* getExec() const {
     return exec;
   }
+  char** getArgs() const {
+    return args;
+  }
   void setCmdLine(std::string newCmdline) { //just to cover up some extreme cases. use with care...
     cmd_line = newCmdline;
   }
@@ -53,19 +73,31 @@ class ExternalCommand : public Command {
 };
 
 class PipeCommand : public Command {
+ public:
+  struct Stage {
+    Command* command; // Owned until execute hands it over to the jobs list.
+    bool pipe_stderr; // The pipe after this stage carries its stderr (|&) rather than its stdout (|).
+  };
+ private:
   bool bg;
+  std::vector<Stage> stages;
  public:
-  PipeCommand(const char* cmd_line, char** args, int args_len, char* exec, bool bg);
-  virtual ~PipeCommand() = default;
+  PipeCommand(const char* cmd_line, char** args, int args_len, char* exec, bool bg, std::vector<Stage>&& stages);
+  virtual ~PipeCommand();
   void execute() override;
 };
 
 class RedirectionCommand : public Command {
   std::string path;
   bool bg;
+  Command* command; // Owned until execute runs it.
+  bool append; // >> rather than >
  public:
-  RedirectionCommand(const char *cmd_line, char** args, int args_lae, char* exec, bool bg);
-  virtual ~RedirectionCommand() {}
+  RedirectionCommand(const char *cmd_line, char** args, int args_lae, char* exec, bool bg,
+                     Command* command, const char* path, bool append);
+  virtual ~RedirectionCommand() {
+    delete command;
+  }
   void execute() override;
 };
 
@@ -77,6 +109,21 @@ public:
     void execute() override;
 };
 
+
+class Launcher;
+struct ParallelProgress;
+
+class ParallelCommand : public Command {
+    bool bg;
+    ParallelProgress* progress = nullptr; // Shared with the helper, see parallel.h.
+public:
+    ParallelCommand(const char *cmd_line, char** args, int args_len, char* exec, bool bg);
+    virtual ~ParallelCommand();
+    void execute() override;
+    pid_t spawn(Launcher& launcher); // Starts the helper, also as a stage of a pipe. -1 on failure.
+    bool getProgress(unsigned* done, unsigned* total) const; // false if there's none to show.
+};
+
 class ChangePromptCommand : public BuiltInCommand {
   public:
   ChangePromptCommand(const char* cmd_line, char** args, int args_len, char* exec) :
@@ -108,6 +155,22 @@ class ShowPidCommand : public BuiltInCommand {
   void execute() override;
 };
 
+class LaunchStatsCommand : public BuiltInCommand {
+ public:
+  LaunchStatsCommand(const char* cmd_line, char** args, int args_len, char* exec) : BuiltInCommand(cmd_line, args, args_len, exec) {}
+  virtual ~LaunchStatsCommand() {}
+  void execute() override;
+};
+
+class HashCommand : public BuiltInCommand {
+  PathCache* path_cache;
+ public:
+  HashCommand(const char* cmd_line, char** args, int args_len, char* exec, PathCache* path_cache) : 
+    BuiltInCommand(cmd_line, args, args_len, exec), path_cache(path_cache) {}
+  virtual ~HashCommand() {}
+  void execute() override;
+};
+
 class QuitCommand : public BuiltInCommand {
   JobsList *job_list;
   public:
@@ -116,14 +179,34 @@ class QuitCommand : public BuiltInCommand {
   void execute() override;
 };
 
+/* A pid can be reused as soon as its process is reaped, and the shell reaps from its event loop at any time.
+So processes are signalled through a pidfd when there is one, which always refers to the same process. */
+int pidfdOpen(pid_t pid); // -1 if the kernel has no pidfds (or pid is gone).
+int signalProcess(pid_t pid, int pidfd, int sig); // pidfd_send_signal, or kill when pidfd is -1. Like kill, 0 or -1.
+
+/* What a job used so far, for jobs -v. Processes that are still running are read from /proc,
+the ones that were reaped (a pipe's finished stages) from what wait4 returned. */
+struct JobUsage {
+  double user = 0; // CPU seconds, children that were waited for included.
+  double sys = 0;
+  long max_rss = 0; // KB, the largest of the processes.
+  long voluntary = 0; // Context switches.
+  long involuntary = 0;
+  long long read_bytes = 0; // Block I/O.
+  long long write_bytes = 0;
+  void add(const struct rusage& usage);
+  void add(const JobUsage& usage);
+  bool read(pid_t pid); // Adds a live process, from /proc. false if it's gone.
+};
+
 class JobsList {
  public:
 
   class JobEntry {
   public:
    Command* cmd;
-   pid_t pid;
-   int jobId;
+   pid_t pid; // A pipe's first process, which leads its process group. -1 while the job is queued.
+   int jobId; // 0 for a pipe in the foreground that was never a job.
    bool isStopped;
    time_t elapsed;
     JobEntry(Command* cmd, pid_t pid, bool isStopped, int jobId) : cmd(cmd), pid(pid), jobId(jobId), isStopped(isStopped) {
@@ -133,28 +216,87 @@ class JobsList {
       }
     }
 
-    ~JobEntry() {
-      delete cmd;
+    int pidfd = -1; // Readable once the process exits, watched by the shell's event loop.
+    /* A pipe is one job: all its stages share a process group, and one killpg stops, continues or kills them all. */
+    pid_t pgid = -1; // -1 for a single process.
+    std::vector<pid_t> members; // The stages that didn't finish yet, empty for a single process.
+    JobUsage reaped; // Stages that finished.
+    ParallelCommand* parallel = nullptr; // A later stage of the pipe that is a parallel, kept for its progress. Owned.
+    /* What a queued job needs when it finally starts */
+    int out_fd = -1; // Its stdout, if it was redirected.
+    Command* timeout = nullptr; // Its timeout command, if it has one. Not owned.
+    int timeout_ms = -1;
+
+    bool isQueued() const {
+      return pid == -1;
     }
+    int sendSignal(int sig) {
+      if (isQueued()) { // kill(-1, ...) would signal everything we may signal.
+        errno = ESRCH;
+        return -1;
+      }
+      // While the group has a member left its id can't be taken, so killpg is as safe as the pidfd.
+      return pgid != -1 ? killpg(pgid, sig) : signalProcess(pid, pidfd, sig);
+    }
+
+    ~JobEntry();
+    void closePidfd(); // Takes it out of the event loop, and closes it.
   };
 
   typedef JobsList::JobEntry JobEntry;
-  std::list<JobEntry*> jobs;
+ private:
+  /* table[jobId] is the job with that id, nullptr for ids not in use. It never ends with a nullptr, so the
+  last job is table.back() and the next id is table.size(). The indexes make everything else O(1) or O(log n). */
+  std::vector<JobEntry*> table;
+  std::unordered_map<pid_t, int> by_pid; // pid -> jobId.
+  std::set<int> stopped; // jobIds of the stopped jobs.
+  std::size_t count = 0;
+  std::unordered_map<pid_t, int> unclaimed; // Statuses reaped for pids that aren't jobs (yet), like foreground ones.
+  /* Background commands beyond max_running wait here, and start (first come first served) as running jobs finish
+  or stop. Finishing is noticed by the reaper, so the queue moves on SIGCHLD (or a pidfd), not by polling. */
+  std::deque<int> queue; // jobIds.
+  int max_running = 0; // 0 for no limit.
+  bool scheduling = false;
+  volatile sig_atomic_t changed = 1; // Set by the SIGCHLD handler: some child has a status for us to reap.
+  bool reaping = true; // false in a forked copy of the shell, the jobs are its parent's children.
+  void insert(JobEntry* job);
+  void erase(JobEntry* job); // Takes it out of the table and the indexes, doesn't delete it.
+  void setStopped(JobEntry* job, bool isStopped);
+  int running() const; // Jobs with processes that aren't stopped.
+  void schedule(); // Starts queued jobs while there's room.
  public:
   JobsList() = default;
   ~JobsList();
   void addJob(Command* cmd, pid_t pid, bool isStopped = false);
-  void printJobsList();
+  void setMaxRunning(int max) {
+    max_running = max;
+  }
+  bool isFull() const {
+    return max_running > 0 && running() >= max_running;
+  }
+  void queueJob(Command* cmd, int out_fd, Command* timeout, int timeout_ms); // Takes out_fd.
+  bool startJob(JobEntry* job); // Starts a queued job now, room or not. false (and the job is gone) if it couldn't.
+  void cancelJob(JobEntry* job); // Removes a queued job without running it.
+  void printJobsList(bool verbose = false); // verbose: with what each job used (see JobUsage).
   void killAllJobs();
-  void removeFinishedJobs();
+  void removeFinishedJobs(); // Reaps whatever children changed state since SIGCHLD last came. Cheap when none did.
+  bool applyStatus(JobEntry* job, pid_t pid, int status, const struct rusage* usage = nullptr); // true if the job finished, and was removed and deleted.
+  bool updateJob(pid_t pid, int status, const struct rusage* usage = nullptr); // false if pid isn't a job.
+  bool takeStatus(pid_t pid, int* status); // Hands out a status reaped for a pid that wasn't a job then.
+  void childChanged() {
+    changed = 1;
+  }
   JobEntry * getJobById(int jobId) const; //returns nullptr if not found.
+  std::vector<JobEntry*> getJobsInRange(int first, int last) const; // Every job with first <= jobId <= last.
   void removeJobById(int jobId);
   JobEntry *getLastJob(int* lastJobId) const; //returns nullptr and sets lastJobId = -1 if not found.
   JobEntry *getLastStoppedJob(int *jobId) const; //same.
   int checkIfStopped(int jobId, bool* res) const; //returns 0 if success, -1 otherwise (i.e., jobId does not exist).
   int removeStopMark(int jobId); // same.
   int addStopMark(int jobId);
-  int addExistingJob(JobEntry* job); //The goal is to add a job that was taken out from the JobsList, and now wants to return (i.e, by ctrl+z)
+  void stopReaping(); // In a forked copy of the shell. Also closes the pidfds, which are the parent's to watch.
+  void reapPid(pid_t pid); // The pidfd of pid says it exited.
+  int addExistingJob(JobEntry* job); //The goal is to add a job that was taken out from the JobsList, and now wants to return (i.e, by ctrl+z). Or a pipe's new job.
 };
 
 
@@ -166,48 +308,50 @@ class JobsCommand : public BuiltInCommand {
   void execute() override;
 };
 
+/* Timeouts are kept in a min-heap by deadline, with a pid index so a process that ends on its own
+drops its timeout in O(log n). A timerfd (CLOCK_MONOTONIC) is armed for the earliest deadline,
+and the shell's event loop calls handleAlarms when it fires, outside of any signal handler. */
 class TimeoutList {
  public:
   struct TimeoutEntry {
     Command* cmd;
     pid_t pid;
-    time_t timestamp;
-    int duration;
-    time_t time_to_kill;
-    TimeoutEntry(Command* cmd, pid_t pid, int duration) : cmd(cmd), pid(pid), duration(duration) {
-      timestamp = time(NULL);
-      if (timestamp == -1) {
-        perror("smash error: time failed");
-      }
-      time_to_kill = timestamp + duration;
-    }
-
-    int timeToLive() const {
-      return difftime(time_to_kill, time(NULL));
-    }
-
+    long long deadline; // Milliseconds on CLOCK_MONOTONIC.
+    std::size_t index; // Where it is in the heap.
+    TimeoutEntry(Command* cmd, pid_t pid, int duration_ms);
     ~TimeoutEntry() {}
   };
-  int minTimeout = -1;
   typedef TimeoutList::TimeoutEntry ToEntry;
-  std::list<ToEntry*> timeouts;
+ private:
+  std::vector<ToEntry*> heap;
+  std::unordered_map<pid_t, ToEntry*> by_pid;
+  int timer_fd = -1;
+  void place(ToEntry* to, std::size_t index);
+  void siftUp(std::size_t index);
+  void siftDown(std::size_t index);
+  void removeAt(std::size_t index); // Takes it out of the heap and the index, doesn't delete it.
+  void arm(); // Sets the timer for the earliest deadline, or disarms it.
  public:
   TimeoutList() = default;
   ~TimeoutList();
-  void addTimeout(Command* cmd, pid_t pid, int duration);
-  void handleAlarms();
-  int findMinTimeout() const;
+  void addTimeout(Command* cmd, pid_t pid, int duration_ms);
+  void handleAlarms(); // Kills everything whose deadline passed.
   void removeByPid(pid_t);
+  int getTimerFd(); // -1 if there's no timer.
+  static long long now(); // CLOCK_MONOTONIC, in milliseconds.
 };
 
 
 class TimeoutCommand : public Command {
   TimeoutList* timeouts;
   bool bg;
+  Command* command; // The command to time, nullptr if the line had none. Owned until execute runs it.
  public:
-  TimeoutCommand(const char* cmd_line, char** args, int args_len, char* exec, TimeoutList* timeouts, bool bg) 
-    : Command(cmd_line, args, args_len, exec), timeouts(timeouts), bg(bg) {}
-  virtual ~TimeoutCommand() {}
+  TimeoutCommand(const char* cmd_line, char** args, int args_len, char* exec, TimeoutList* timeouts, bool bg, Command* command) 
+    : Command(cmd_line, args, args_len, exec), timeouts(timeouts), bg(bg), command(command) {}
+  virtual ~TimeoutCommand() {
+    delete command;
+  }
   void execute() override;
 };
 
@@ -256,17 +400,43 @@ class SmallShell {
   const char* old_pwd = NULL;
   JobsList jobs;
   TimeoutList timeouts;
+  Arena line_arena; // args and exec strings of the line being executed.
+  ParsedLine parsed; // The line being executed.
+  PathCache path_cache;
   pid_t fg_pid = -1;
-  pid_t second_fg_pid = -1; // For pipes.
+  int fg_pidfd = -1; // Not owned.
+  JobEntry* fg_group = nullptr; // A pipe in the foreground. Not in the jobs list while it's there.
 
   /* For timeouts */
-  int duration = -1;
+  int duration = -1; // In milliseconds.
   Command* toTimeout = nullptr;
+  /* The event loop (waitForEvents): one epoll over stdin, a signalfd for the signals we handle,
+  the timeouts' timerfd and a pidfd per job. */
+  int epoll_fd = -1;
+  int signal_fd = -1;
+  bool input_pollable = true; // false when stdin is a regular file, which epoll can't watch (and is always ready).
+  bool input_watched = false;
+  std::unordered_map<pid_t, int> watched; // pid -> its pidfd in the loop.
+  std::string input; // Read from stdin and not yet returned by readLine.
   int stdout_fd = -1; 
+  pid_t pid;
+  int pipe_size = 0; // F_SETPIPE_SZ for pipes, 0 keeps the kernel's default. Set by $SMASH_PIPE_SIZE.
+
+  /* External launches, and how many of them skipped the /bin/bash -c trampoline */
+  int launches = 0;
+  int direct_launches = 0;
   
   SmallShell();
+  bool drainSignals(); // Handles what's pending on the signalfd, without blocking. true if SIGALRM was among it.
+  char* copyText(std::string_view text);
+  int copyWords(std::size_t first, std::size_t count, char*** args);
+  Command* buildLine(const char* cmd_line, std::size_t skip);
+  Command* buildPipeline(const char* cmd_line, std::size_t skip);
+  Command* buildSimple(const char* cmd_line, const ParsedLine::Stage& stage, std::size_t skip);
  public:
+  typedef Command* (*CommandFactory)(SmallShell& smash, const char* cmd_line, char** args, int args_len, char* exec, bool bg);
   Command *CreateCommand(const char* cmd_line);
+  static CommandFactory findCommand(const char* name); // Builtins and the like, nullptr for an external command.
   SmallShell(SmallShell const&)      = delete; // disable copy ctor
   void operator=(SmallShell const&)  = delete; // disable = operator
   static SmallShell& getInstance() // make SmallShell singleton
@@ -280,24 +450,56 @@ class SmallShell {
 
   void changePromptName(const char* new_name);
 
+  JobsList* getJobs() {
+    return &jobs;
+  }
+  TimeoutList* getTimeouts() {
+    return &timeouts;
+  }
+  PathCache* getPathCache() {
+    return &path_cache;
+  }
+  const char* lookupPath(const char* name) {
+    return path_cache.lookup(name);
+  }
+  char** getOldPwd() {
+    return (char**)&old_pwd;
+  }
+
   std::string getPromptName();
 
   void addJob(Command* cmd, pid_t pid, bool isStopped = false);
   void addJob(JobEntry* job, bool isStopped = false);
 
-  void removeJobs() {
-    jobs.removeFinishedJobs();
-  }
 
-  void setForegroundProcess(pid_t fg);
+  void setForegroundProcess(pid_t fg, int pidfd = -1);
   pid_t getForegroundPid() const;
-  void setPipedForegroundProcess (pid_t pid) {
-    second_fg_pid = pid;
+  int signalForeground(int sig) const { // -1 (with errno) if it failed, 0 also if there is nothing in the foreground.
+    return fg_pid == -1 ? 0 : signalProcess(fg_pid, fg_pidfd, sig);
+  }
+  void setForegroundGroup(JobEntry* group) {
+    fg_group = group;
+  }
+  JobEntry* getForegroundGroup() const {
+    return fg_group;
+  }
+  pid_t getPid() const {
+    return pid;
+  }
+  void enterSubshell(); // In a forked child that runs a built-in stage of a pipe.
+  int getPipeSize() const {
+    return pipe_size;
+  }
+  void updateJob(pid_t pid, int status) {
+    jobs.updateJob(pid, status);
   }
-  pid_t getPipedForegroundPid() const {
-    return second_fg_pid;
+  void childChanged() { // From the SIGCHLD handler.
+    jobs.childChanged();
   }
+  pid_t waitChild(pid_t pid, int* status); // waitpid(pid, status, WUNTRACED), for a child that isn't a job.
   void cleanup();
+  void countLaunch(bool direct);
+  void getLaunchStats(int* total, int* direct) const;
   void handleAlarms();
   void addTimeout(Command* cmd, pid_t pid, int duration) {
     timeouts.addTimeout(cmd, pid, duration);
@@ -321,6 +523,11 @@ class SmallShell {
   void removeTimeout(pid_t pid) {
     timeouts.removeByPid(pid);
   }
+  void initEvents(); // Blocks SIGINT, SIGTSTP, SIGCHLD and SIGALRM, from then on they come through waitForEvents.
+  int watchPid(pid_t pid); // Returns a pidfd for pid, watched by the event loop, or -1.
+  void unwatchPid(pid_t pid); // Once pid is reaped its pidfd stays readable, it must not stay in the loop. Doesn't close it.
+  bool waitForEvents(bool input, bool block = true); // Handles events until at least one came (or just the pending ones, without block). true if stdin is readable (with input).
+  bool readLine(std::string& line); // false on end of input.
 };
 
 #endif //SMASH_COMMAND_H_
\ No newline at end of file
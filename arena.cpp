@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "arena.h"
+
+Arena::Chunk* Arena::newChunk(std::size_t min_size) {
+  std::size_t size = min_size > CHUNK_SIZE ? min_size : CHUNK_SIZE;
+  Chunk* chunk = static_cast<Chunk*>(malloc(offsetof(Chunk, data) + size));
+  if (!chunk) {
+    throw std::bad_alloc();
+  }
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+Arena::~Arena() {
+  while (head) {
+    Chunk* next = head->next;
+    free(head);
+    head = next;
+  }
+}
+
+void* Arena::allocate(std::size_t size, std::size_t align) {
+  if (head) {
+    std::size_t start = (head->used + align - 1) & ~(align - 1);
+    if (start + size <= head->size) {
+      head->used = start + size;
+      return head->data + start;
+    }
+  }
+  Chunk* chunk = newChunk(size);
+  chunk->next = head;
+  head = chunk;
+  chunk->used = size;
+  return chunk->data;
+}
+
+char* Arena::copy(const char* str, std::size_t len) {
+  char* res = static_cast<char*>(allocate(len + 1, 1));
+  memcpy(res, str, len);
+  res[len] = '\0';
+  return res;
+}
+
+void Arena::reset() {
+  /* Keep only the biggest chunk, so the next line of the same size fits in it again. */
+  Chunk* biggest = head;
+  for (Chunk* chunk = head; chunk; chunk = chunk->next) {
+    if (chunk->size > biggest->size) biggest = chunk;
+  }
+  while (head) {
+    Chunk* next = head->next;
+    if (head != biggest) free(head);
+    head = next;
+  }
+  head = biggest;
+  if (head) {
+    head->next = nullptr;
+    head->used = 0;
+  }
+}
+
+/* Command objects come in a handful of sizes, so one free list per 64 bytes size class is enough. */
+static const std::size_t POOL_GRANULARITY = 64;
+static const std::size_t POOL_CLASSES = 8;
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+static FreeBlock* free_lists[POOL_CLASSES];
+
+void* poolAllocate(std::size_t size) {
+  std::size_t cls = (size - 1) / POOL_GRANULARITY;
+  if (cls >= POOL_CLASSES) {
+    return ::operator new(size);
+  }
+  if (free_lists[cls]) {
+    FreeBlock* block = free_lists[cls];
+    free_lists[cls] = block->next;
+    return block;
+  }
+  return ::operator new((cls + 1) * POOL_GRANULARITY);
+}
+
+void poolFree(void* ptr, std::size_t size) {
+  if (!ptr) {
+    return;
+  }
+  std::size_t cls = (size - 1) / POOL_GRANULARITY;
+  if (cls >= POOL_CLASSES) {
+    ::operator delete(ptr);
+    return;
+  }
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+  block->next = free_lists[cls];
+  free_lists[cls] = block;
+}
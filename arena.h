@@ -0,0 +1,34 @@
+#ifndef SMASH_ARENA_H_
+#define SMASH_ARENA_H_
+
+#include <cstddef>
+
+/* Bump allocator for everything that lives only as long as one input line (args, exec strings...).
+Allocation is a pointer increment, and reset() releases all of it at once. The first chunk is kept
+between lines, so a shell that handles lines of a steady size stops calling malloc altogether. */
+class Arena {
+  struct Chunk {
+    Chunk* next;
+    std::size_t size;
+    std::size_t used;
+    alignas(std::max_align_t) char data[1];
+  };
+  Chunk* head = nullptr; // The chunk we are allocating from. Older (full) chunks follow it.
+  static const std::size_t CHUNK_SIZE = 4096;
+  Chunk* newChunk(std::size_t min_size);
+ public:
+  Arena() = default;
+  ~Arena();
+  Arena(Arena const&) = delete;
+  void operator=(Arena const&) = delete;
+  void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t));
+  char* copy(const char* str, std::size_t len); // Returns a null terminated copy of str[0..len).
+  void reset();
+};
+
+/* Free lists for Command objects, so a new/delete pair per line recycles the same memory
+instead of going to malloc. Used by Command's operator new/delete. */
+void* poolAllocate(std::size_t size);
+void poolFree(void* ptr, std::size_t size);
+
+#endif //SMASH_ARENA_H_
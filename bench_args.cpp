@@ -0,0 +1,51 @@
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include "arena.h"
+#include "parser.h"
+
+/* Benchmark of what every line goes through before its command is built (make bench): parsing it into words,
+and copying their values into an args array in the line arena, the way SmallShell::copyWords does.
+Lines of 1, 20 (the most that stay inline), 1k and 100k arguments, about the same number of words each.
+ns per argument should stay about the same from row to row, there is no per-word reallocation to show up. */
+
+#define BENCH_WORDS_TOTAL (2000000)
+
+static volatile char sink; // So the copies can't be optimized away.
+
+static void run(std::size_t count, ParsedLine& parsed, Arena& arena) {
+  std::string line = "echo";
+  for (std::size_t i = 1; i < count; i++) {
+    line += i % 10 == 0 ? " 'quoted arg'" : " arg" + std::to_string(i);
+  }
+  std::size_t reps = BENCH_WORDS_TOTAL / count;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t rep = 0; rep < reps; rep++) {
+    arena.reset(); // As executeCommand does for every line.
+    parseLine(line, parsed);
+    std::size_t words = parsed.words.size();
+    char** args = static_cast<char**>(arena.allocate(sizeof(char*) * (words + 1)));
+    for (std::size_t i = 0; i < words; ++i) {
+      args[i] = static_cast<char*>(arena.allocate(parsed.words[i].text.size() + 1, 1));
+      unquote(parsed.words[i], args[i]);
+    }
+    args[words] = nullptr;
+    sink = args[words - 1][0];
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  std::cout << std::setw(8) << count << std::setw(14) << std::fixed << std::setprecision(1) << ns / reps / 1000
+            << std::setw(14) << ns / reps / count << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  /* One ParsedLine and one arena for all the lines, like the shell's. Short lines go first,
+  so they are timed before any long line made the words spill to the heap. */
+  ParsedLine parsed;
+  Arena arena;
+  std::cout << std::setw(8) << "args" << std::setw(14) << "us per line" << std::setw(14) << "ns per arg" << std::endl;
+  for (std::size_t count : {1, 20, 1000, 100000}) {
+    run(count, parsed, arena);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include "Commands.h"
+
+/* Benchmark of finding a line's command (make bench): the perfect hash table (SmallShell::findCommand)
+against what CreateCommand did before it, a copy of the line scanned for > and | with find_first_of,
+then a strcmp for every builtin in turn. Both get the first word already split off, as the parser gives it.
+The lines are a mix of builtins, late ones in the old chain included, and external commands,
+which went through every strcmp. */
+
+#define BENCH_ROUNDS (200000)
+
+static volatile long sink; // So the lookups can't be optimized away.
+
+static const char* const LINES[] = {
+  "ls", "jobs", "fg %1", "bg", "quit kill", "kill -9 %2", "cd ..", "pwd", "showpid", "chprompt prompt",
+  "cp big.iso /mnt/backup", "launchstats", "sleep 100 &", "echo hello world", "cat notes.txt",
+  "grep -rn needle src/", "make -j8", "git status", "timeout 5 sleep 10", "ls -la /tmp",
+};
+
+// CreateCommand before the table, down to what it compared. Returns which branch matched.
+static int oldDispatch(const char* cmd_line, char** args) {
+  std::string cmd_str = std::string(cmd_line);
+  if (strcmp(args[0], "timeout") == 0) return 1;
+  if (cmd_str.find_first_of(">") != std::string::npos) return 2;
+  else if (cmd_str.find_first_of("|") != std::string::npos) return 3;
+  else if (strcmp(args[0], "chprompt") == 0) return 4;
+  else if (strcmp(args[0], "ls") == 0 && args[1] == NULL) return 5;
+  else if (strcmp(args[0], "showpid") == 0) return 6;
+  else if (strcmp(args[0], "pwd") == 0) return 7;
+  else if (strcmp(args[0], "cp") == 0) return 8;
+  else if (strcmp(args[0], "cd") == 0) return 9;
+  else if (strcmp(args[0], "kill") == 0) return 10;
+  else if (strcmp(args[0], "jobs") == 0) return 11;
+  else if (strcmp(args[0], "fg") == 0) return 12;
+  else if (strcmp(args[0], "bg") == 0) return 13;
+  else if (strcmp(args[0], "launchstats") == 0) return 14;
+  else if (strcmp(args[0], "quit") == 0) return 15;
+  return 0; // External
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> firsts, seconds;
+  std::vector<char*> args; // Two per line: the first word and what follows it (or nullptr).
+  size_t count = sizeof(LINES) / sizeof(LINES[0]);
+  for (size_t i = 0; i < count; i++) {
+    const char* space = strchr(LINES[i], ' ');
+    firsts.emplace_back(LINES[i], space ? space - LINES[i] : strlen(LINES[i]));
+    seconds.emplace_back(space ? space + 1 : "");
+  }
+  for (size_t i = 0; i < count; i++) {
+    args.push_back(&firsts[i][0]);
+    args.push_back(seconds[i].empty() ? nullptr : &seconds[i][0]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < count; i++) {
+      sink = oldDispatch(LINES[i], &args[2 * i]);
+    }
+  }
+  double old_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (size_t i = 0; i < count; i++) {
+      sink = strcmp(args[2 * i], "timeout") == 0 || SmallShell::findCommand(args[2 * i]) != nullptr; // As buildSimple does.
+    }
+  }
+  double new_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  double lines = (double)BENCH_ROUNDS * count;
+  std::cout << std::setw(24) << "dispatch" << std::setw(14) << "ns per line" << std::endl;
+  std::cout << std::setw(24) << "find_first_of + strcmp" << std::setw(14) << std::fixed << std::setprecision(1)
+            << old_ns / lines << std::endl;
+  std::cout << std::setw(24) << "perfect hash" << std::setw(14) << new_ns / lines << std::endl;
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include "Commands.h"
+
+/* Scaling benchmark of the job table (make bench): every JobsList operation, with 10, 1k and 100k jobs.
+The ns/op of each column should stay about the same from row to row, it's the quadratic loops it catches.
+No processes are started. The jobs get pids above any pid_max, so nothing real is ever signalled or waited for,
+and the shell's event loop isn't set up, so there are no pidfds either. */
+
+#define BENCH_PID_BASE (100000000)
+
+static volatile long sink; // So the lookups can't be optimized away.
+
+class BenchCommand : public Command {
+ public:
+  BenchCommand(char** args) : Command("sleep 100 &", args, 2, args[0]) {}
+  void execute() override {}
+};
+
+static double nsPerOp(std::chrono::steady_clock::time_point start, size_t ops) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+static void run(int n, std::mt19937& random) {
+  JobsList jobs;
+  char sleep[] = "sleep", hundred[] = "100";
+  char* args[] = {sleep, hundred, nullptr};
+  std::vector<int> ids(n);
+  for (int i = 0; i < n; i++) {
+    ids[i] = i + 1;
+  }
+  std::shuffle(ids.begin(), ids.end(), random);
+  std::vector<double> results;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    jobs.addJob(new BenchCommand(args), BENCH_PID_BASE + i);
+  }
+  results.push_back(nsPerOp(start, n));
+
+  start = std::chrono::steady_clock::now();
+  for (int id : ids) {
+    bool stopped;
+    sink = jobs.getJobById(id)->pid + jobs.checkIfStopped(id, &stopped);
+  }
+  results.push_back(nsPerOp(start, n));
+
+  start = std::chrono::steady_clock::now();
+  for (int id : ids) { // What ctrl-Z, fg and bg do to the table.
+    int last;
+    jobs.addStopMark(id);
+    jobs.getLastStoppedJob(&last);
+    jobs.removeStopMark(id);
+    sink = last;
+  }
+  results.push_back(nsPerOp(start, n));
+
+  start = std::chrono::steady_clock::now();
+  for (int id : ids) { // fg takes a job out, and ctrl-Z puts it back.
+    JobsList::JobEntry* job = jobs.getJobById(id);
+    jobs.removeJobById(id);
+    jobs.addExistingJob(job);
+  }
+  results.push_back(nsPerOp(start, n));
+
+  start = std::chrono::steady_clock::now();
+  for (int id : ids) { // The reaper, by pid, which also deletes the job.
+    jobs.updateJob(BENCH_PID_BASE + id - 1, W_EXITCODE(0, 0));
+  }
+  results.push_back(nsPerOp(start, n));
+
+  std::cout << std::setw(8) << n;
+  for (double result : results) {
+    std::cout << std::setw(14) << std::fixed << std::setprecision(1) << result;
+  }
+  std::cout << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  std::mt19937 random(1);
+  std::cout << "ns per operation" << std::endl;
+  std::cout << std::setw(8) << "jobs" << std::setw(14) << "add" << std::setw(14) << "lookup" << std::setw(14)
+            << "stop/cont" << std::setw(14) << "out/back" << std::setw(14) << "reap" << std::endl;
+  for (int n : {10, 1000, 100000}) {
+    run(n, random);
+  }
+  return 0;
+}
@@ -0,0 +1,1146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <string.h>
+#include <limits.h>
+#include <limits>
+#include <algorithm>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "copy.h"
+#include "crc32c.h"
+#include "uring.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+#define COPY_CHUNK (1L << 30) // Most bytes we ask copy_file_range/sendfile for in one call.
+#define BUFFER_MIN (128 * 1024)
+#define BUFFER_MAX (8 * 1024 * 1024)
+#define COPY_WORKERS_MAX (16)
+#define URING_CHUNK (256 * 1024)
+#define RESUME_MIN (64L * 1024 * 1024) // Smaller files are just copied again.
+#define RESUME_STEP (64L * 1024 * 1024) // Bytes copied between checkpoints.
+#define RESUME_SUFFIX ".smash-resume"
+#define CHECKPOINT_RECORD (128)
+
+const char* copyStrategyName(CopyStrategy strategy) {
+  switch (strategy) {
+    case COPY_REFLINK: return "reflink";
+    case COPY_RANGE: return "copy_file_range";
+    case COPY_SENDFILE: return "sendfile";
+    case COPY_URING: return "io_uring";
+    default: return "read/write";
+  }
+}
+
+bool same_file(int fd1, int fd2) {
+  struct stat stat1, stat2;
+  if (fstat(fd1, &stat1) < 0) {
+    perror("smash error: fstat failed");
+    return false;
+  }
+  if (fstat(fd2, &stat2) < 0) {
+    perror("smash error: fstat failed");
+    return false;
+  }
+  return (stat1.st_dev == stat2.st_dev) && (stat1.st_ino == stat2.st_ino);
+}
+
+//Errors that mean "this strategy can't be used for these files", as opposed to a real I/O error.
+static bool unsupported(int error) {
+  return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP ||
+         error == ENOTTY || error == EBADF || error == ETXTBSY || error == EPERM;
+}
+
+static bool tryReflink(int src, int dst, CopyStats& stats) {
+  /* A clone replaces the whole destination, so it only fits a copy of the whole source
+  into a fresh (truncated) destination, which is what cp gives us unless we copy a file onto itself. */
+  struct stat st;
+  if (lseek(src, 0, SEEK_CUR) != 0 || fstat(dst, &st) == -1 || st.st_size != 0) {
+    return false;
+  }
+  if (ioctl(dst, FICLONE, src) == -1 || fstat(src, &st) == -1) {
+    return false;
+  }
+  stats.bytes = st.st_size;
+  return true;
+}
+
+/* The strategy loops copy up to left bytes (less if the source ends first) and count left down.
+They move the file offsets as they go, so when one gives up halfway (it returns -1 with errno set
+to why) the next strategy just continues from where it stopped. */
+static int rangeLoop(int src, int dst, off_t& left, CopyStats& stats) {
+  while (left > 0) {
+    ssize_t num = copy_file_range(src, nullptr, dst, nullptr, std::min<off_t>(left, COPY_CHUNK), 0);
+    if (num == 0) return 0;
+    if (num == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    stats.bytes += num;
+    left -= num;
+  }
+  return 0;
+}
+
+static int sendfileLoop(int src, int dst, off_t& left, CopyStats& stats) {
+  while (left > 0) {
+    ssize_t num = sendfile(dst, src, nullptr, std::min<off_t>(left, COPY_CHUNK));
+    if (num == 0) return 0;
+    if (num == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    stats.bytes += num;
+    left -= num;
+  }
+  return 0;
+}
+
+/* With verify, every chunk is read back from dst right after it's written, while it's still in the page
+cache, and its checksum is compared with the one of what we read from src. */
+static bool bufferedLoop(int src, int dst, off_t& left, CopyStats& stats, bool verify) {
+  //Start with a modest buffer (small files don't need more) and double it every time a read fills it.
+  size_t size = BUFFER_MIN;
+  char* buffer = (char*)malloc(size);
+  char* check = verify ? (char*)malloc(size) : nullptr;
+  if (!buffer || (verify && !check)) {
+    perror("smash error: malloc failed");
+    free(buffer);
+    free(check);
+    return false;
+  }
+  off_t position = verify ? lseek(dst, 0, SEEK_CUR) : 0;
+  posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+  bool ok = true;
+  while (ok && left > 0) {
+    ssize_t num = read(src, buffer, std::min<off_t>(left, size));
+    if (num == 0) break;
+    if (num == -1) {
+      if (errno == EINTR) continue;
+      perror("smash error: read failed");
+      ok = false;
+      break;
+    }
+    ssize_t write_amount = 0;
+    while (write_amount < num) {
+      ssize_t wrote = write(dst, buffer + write_amount, num - write_amount);
+      if (wrote < 0) {
+        if (errno == EINTR) continue;
+        perror("smash error: write failed");
+        ok = false;
+        break;
+      }
+      write_amount += wrote;
+    }
+    if (ok && verify) {
+      //Both chained from the crc so far: the one of what we read is the file's crc up to here, no second pass.
+      uint32_t expected = crc32c(stats.crc, buffer, num);
+      ssize_t got = 0, back;
+      while (got < num && (back = pread(dst, check + got, num - got, position + got)) > 0) {
+        got += back;
+      }
+      if (got != num || crc32c(stats.crc, check, num) != expected) {
+        cout << "smash error: cp: verification failed at offset " << position << endl;
+        ok = false;
+        break;
+      }
+      stats.crc = expected;
+      position += num;
+    }
+    stats.bytes += num;
+    left -= num;
+    if ((size_t)num == size && size < BUFFER_MAX) {
+      char* bigger = (char*)realloc(buffer, size * 2);
+      if (bigger) {
+        buffer = bigger;
+        size *= 2;
+      }
+      if (verify && bigger) {
+        char* bigger_check = (char*)realloc(check, size);
+        if (bigger_check) {
+          check = bigger_check;
+        } else {
+          size /= 2; // buffer is big enough either way, just don't read more than check holds.
+        }
+      }
+    }
+  }
+  free(buffer);
+  free(check);
+  return ok;
+}
+
+/* Keeps up to depth chunks in flight through an io_uring: each slot reads a chunk at its offset,
+writes it to the same offset in dst, then goes on to the next chunk nobody took yet. So reads and
+writes of different chunks overlap, and finish in whatever order the device likes. Only for
+regular files, as it goes by offsets. Returns 0 when done, -1 with errno set when there's no
+io_uring to use (nothing was copied, another strategy can do it) and 1 after an I/O error. */
+static int uringLoop(int src, int dst, off_t& left, unsigned depth, CopyStats& stats) {
+  struct stat st;
+  off_t src_start = lseek(src, 0, SEEK_CUR), dst_start = lseek(dst, 0, SEEK_CUR);
+  if (fstat(src, &st) == -1 || !S_ISREG(st.st_mode) || src_start == -1 || dst_start == -1) {
+    errno = EINVAL;
+    return -1;
+  }
+  off_t limit = std::max<off_t>(0, std::min<off_t>(left, st.st_size - src_start));
+  depth = std::max<off_t>(1, std::min<off_t>(depth, (limit + URING_CHUNK - 1) / URING_CHUNK));
+  Uring ring(depth * 2); // Room for the slots' sqes even before the kernel takes the last batch.
+  if (!ring.ok()) {
+    return -1;
+  }
+  struct Slot {
+    off_t offset; // Relative to where we started, the next byte this slot reads or writes.
+    off_t end; // End of its chunk.
+    off_t len; // Read and not yet written.
+    bool writing;
+  };
+  vector<Slot> slots(depth);
+  char* buffers = (char*)malloc((size_t)depth * URING_CHUNK);
+  if (!buffers) {
+    perror("smash error: malloc failed");
+    return 1;
+  }
+  off_t next = 0, copied = 0;
+  unsigned active = 0;
+  bool failed = false;
+  auto queue = [&](unsigned i) {
+    Slot& slot = slots[i];
+    char* buffer = buffers + (size_t)i * URING_CHUNK;
+    io_uring_sqe* sqe = ring.next();
+    if (slot.writing) {
+      ring.prepare(sqe, IORING_OP_WRITE, dst, buffer, slot.len, dst_start + slot.offset, i);
+    } else {
+      ring.prepare(sqe, IORING_OP_READ, src, buffer, slot.end - slot.offset, src_start + slot.offset, i);
+    }
+  };
+  auto take = [&](unsigned i) { // Gives slot i the next chunk, if there's one left.
+    if (next >= limit || failed) {
+      active--;
+      return;
+    }
+    slots[i] = Slot{next, std::min<off_t>(next + URING_CHUNK, limit), 0, false};
+    next = slots[i].end;
+    queue(i);
+  };
+  for (unsigned i = 0; i < depth; i++) {
+    active++;
+    take(i);
+  }
+  while (active > 0) {
+    if (ring.submit(1) == -1) {
+      perror("smash error: io_uring_enter failed");
+      failed = true;
+      break; // Can't wait for the ones in flight either, the buffers must stay.
+    }
+    io_uring_cqe cqe;
+    while (ring.reap(cqe)) {
+      unsigned i = cqe.user_data;
+      Slot& slot = slots[i];
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        queue(i);
+        continue;
+      }
+      if (cqe.res < 0 || (cqe.res == 0 && !slot.writing)) {
+        if (cqe.res < 0 && !failed) {
+          errno = -cqe.res;
+          perror(slot.writing ? "smash error: write failed" : "smash error: read failed");
+          failed = true;
+        }
+        if (cqe.res == 0) {
+          limit = std::min(limit, slot.offset); // The file got shorter since we looked.
+        }
+        active--;
+        continue;
+      }
+      if (!slot.writing) {
+        slot.len = cqe.res;
+        slot.writing = true;
+        queue(i);
+        continue;
+      }
+      //A short write (or read, before it) leaves the rest of the chunk for another round.
+      char* buffer = buffers + (size_t)i * URING_CHUNK;
+      memmove(buffer, buffer + cqe.res, slot.len - cqe.res);
+      slot.len -= cqe.res;
+      slot.offset += cqe.res;
+      copied += cqe.res;
+      if (slot.len > 0) {
+        queue(i);
+      } else if (slot.offset < slot.end && !failed) {
+        slot.writing = false;
+        queue(i);
+      } else {
+        take(i);
+      }
+    }
+  }
+  if (active == 0) {
+    free(buffers); // With something still in flight we leak them rather than let the kernel write into freed memory.
+  }
+  stats.bytes += copied;
+  left -= copied;
+  if (failed) {
+    return 1;
+  }
+  lseek(src, src_start + copied, SEEK_SET);
+  lseek(dst, dst_start + copied, SEEK_SET);
+  return 0;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copies length bytes (or up to the end of src), starting with stats.strategy and falling back from there.
+Verifying needs the data to pass through our buffer, so it always goes with read/write. */
+static bool copyRange(int src, int dst, off_t length, const CopyOptions& options, CopyStats& stats) {
+  if (options.verify) {
+    stats.strategy = COPY_BUFFERED;
+  }
+  if (stats.strategy == COPY_URING) {
+    int result = uringLoop(src, dst, length, options.uring_depth, stats);
+    if (result != -1) return result == 0;
+    stats.strategy = COPY_RANGE; // No io_uring here, copy like we would without it.
+  }
+  if (stats.strategy == COPY_RANGE) {
+    if (rangeLoop(src, dst, length, stats) == 0) return true;
+    if (!unsupported(errno)) {
+      perror("smash error: copy_file_range failed");
+      return false;
+    }
+    stats.strategy = COPY_SENDFILE;
+  }
+  if (stats.strategy == COPY_SENDFILE) {
+    if (sendfileLoop(src, dst, length, stats) == 0) return true;
+    if (!unsupported(errno)) {
+      perror("smash error: sendfile failed");
+      return false;
+    }
+    stats.strategy = COPY_BUFFERED;
+  }
+  return bufferedLoop(src, dst, length, stats, options.verify);
+}
+
+/* Copies only the data extents of a sparse file, each to the same offset in dst, which must start out
+empty. The holes between them are left unwritten, so they stay holes, and the ftruncate at the end
+adds a hole the file ends with. */
+static bool copyExtents(int src, int dst, off_t size, const CopyOptions& options, CopyStats& stats) {
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data = lseek(src, offset, SEEK_DATA);
+    if (data == -1) {
+      if (errno == ENXIO) break; // Nothing but a hole up to the end.
+      //The filesystem can't tell us where the data is, copy all of it.
+      return lseek(src, offset, SEEK_SET) != -1 && lseek(dst, offset, SEEK_SET) != -1 &&
+             copyRange(src, dst, size - offset, options, stats);
+    }
+    off_t hole = lseek(src, data, SEEK_HOLE);
+    if (hole == -1 || hole > size) {
+      hole = size;
+    }
+    if (lseek(src, data, SEEK_SET) == -1 || lseek(dst, data, SEEK_SET) == -1) {
+      perror("smash error: lseek failed");
+      return false;
+    }
+    if (!copyRange(src, dst, hole - data, options, stats)) {
+      return false;
+    }
+    offset = hole;
+  }
+  if (ftruncate(dst, size) == -1) {
+    perror("smash error: ftruncate failed");
+    return false;
+  }
+  return true;
+}
+
+bool copyData(int src, int dst, const CopyOptions& options, CopyStats& stats) {
+  double start = now();
+  bool ok = true;
+  stats.bytes = 0;
+  stats.sparse = false;
+  stats.crc = 0;
+  stats.strategy = COPY_REFLINK;
+  if (options.verify || !tryReflink(src, dst, stats)) {
+    stats.strategy = options.uring_depth > 0 ? COPY_URING : COPY_RANGE;
+    //Fewer blocks than the size needs means holes. Only worth it for a whole file copied into an empty one.
+    struct stat src_st, dst_st;
+    stats.sparse = fstat(src, &src_st) == 0 && S_ISREG(src_st.st_mode) &&
+                   src_st.st_blocks * 512 < src_st.st_size && fstat(dst, &dst_st) == 0 &&
+                   dst_st.st_size == 0 && lseek(src, 0, SEEK_CUR) == 0 && lseek(dst, 0, SEEK_CUR) == 0;
+    if (stats.sparse) {
+      ok = copyExtents(src, dst, src_st.st_size, options, stats);
+    } else {
+      ok = copyRange(src, dst, std::numeric_limits<off_t>::max(), options, stats);
+    }
+  }
+  stats.seconds = now() - start;
+  return ok;
+}
+
+/* Resumable copies */
+
+/* A big file is copied in RESUME_STEP steps, and after each one the sidecar file next to the
+destination (destination + RESUME_SUFFIX) records how far we got, which source that was, and
+checksums of what's in the destination: of the whole prefix and of the last step alone.
+cp --resume goes on from there, if the source didn't change and the destination's prefix is still
+what we wrote (its checksum matches). The sidecar is deleted once the copy is complete.
+Only with --checkpoint or --resume: every step is read back for its checksum, and copied in steps,
+which costs a plain copy_file_range/sendfile of the whole file a lot. */
+struct Checkpoint {
+  off_t offset = 0; // Bytes of the destination that are done.
+  off_t size = 0; // Of the source, which with its mtime and inode tells it wasn't replaced or changed.
+  time_t mtime_sec = 0;
+  long mtime_nsec = 0;
+  ino_t ino = 0;
+  uint32_t crc = 0; // crc32c of the destination's first offset bytes.
+  off_t step = 0; // Where the last step started.
+  uint32_t step_crc = 0; // crc32c of the destination from step to offset.
+};
+
+static string checkpointPath(const string& destination) {
+  return destination + RESUME_SUFFIX;
+}
+
+//Computes the crc32c of fd's bytes from offset to offset + len into both crcs (which go on from what they hold).
+static bool crcRange(int fd, off_t offset, off_t len, uint32_t& crc, uint32_t& other) {
+  vector<char> buffer(1024 * 1024);
+  while (len > 0) {
+    ssize_t num = pread(fd, buffer.data(), std::min<off_t>(len, buffer.size()), offset);
+    if (num <= 0) {
+      if (num == -1 && errno == EINTR) continue;
+      if (num == -1) perror("smash error: read failed");
+      return false;
+    }
+    crc = crc32c(crc, buffer.data(), num);
+    other = crc32c(other, buffer.data(), num);
+    offset += num;
+    len -= num;
+  }
+  return true;
+}
+
+static bool readCheckpoint(const string& path, Checkpoint& checkpoint) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    return false;
+  }
+  long long offset, size, mtime_sec, step;
+  unsigned long long ino;
+  bool ok = fscanf(file, "smash-resume %lld %lld %lld %ld %llu %x %lld %x", &offset, &size, &mtime_sec,
+                   &checkpoint.mtime_nsec, &ino, &checkpoint.crc, &step, &checkpoint.step_crc) == 8;
+  fclose(file);
+  checkpoint.offset = offset;
+  checkpoint.size = size;
+  checkpoint.mtime_sec = mtime_sec;
+  checkpoint.ino = ino;
+  checkpoint.step = step;
+  return ok;
+}
+
+static bool writeCheckpoint(int fd, const Checkpoint& checkpoint) {
+  //Always the same length, in one pwrite, so a kill can't leave half of it or the tail of an older one.
+  char record[CHECKPOINT_RECORD];
+  memset(record, ' ', sizeof(record));
+  int len = snprintf(record, sizeof(record), "smash-resume %lld %lld %lld %ld %llu %08x %lld %08x",
+                     (long long)checkpoint.offset, (long long)checkpoint.size, (long long)checkpoint.mtime_sec,
+                     checkpoint.mtime_nsec, (unsigned long long)checkpoint.ino, checkpoint.crc,
+                     (long long)checkpoint.step, checkpoint.step_crc);
+  record[len] = ' ';
+  record[sizeof(record) - 1] = '\n';
+  if (pwrite(fd, record, sizeof(record), 0) != sizeof(record)) {
+    perror("smash error: write failed");
+    return false;
+  }
+  return true;
+}
+
+static bool usableCheckpoint(const Checkpoint& checkpoint, const struct stat& src_st, int dst) {
+  struct stat dst_st;
+  if (checkpoint.size != src_st.st_size || checkpoint.mtime_sec != src_st.st_mtim.tv_sec ||
+      checkpoint.mtime_nsec != src_st.st_mtim.tv_nsec || checkpoint.ino != src_st.st_ino ||
+      checkpoint.offset > checkpoint.size || checkpoint.step > checkpoint.offset ||
+      fstat(dst, &dst_st) == -1 || dst_st.st_size < checkpoint.offset) {
+    return false;
+  }
+  //The whole prefix, not just the last step: what we skip must be what we wrote, all of it. Reading it costs less than copying it again.
+  uint32_t crc = 0, ignored = 0;
+  return crcRange(dst, 0, checkpoint.offset, crc, ignored) && crc == checkpoint.crc;
+}
+
+//Copies src to dst from checkpoint.offset on, writing checkpoints to the sidecar of destination as it goes.
+static bool copyCheckpointed(int src, int dst, const struct stat& src_st, const string& destination,
+                             Checkpoint& checkpoint, const CopyOptions& options, CopyStats& stats) {
+  double start = now();
+  stats.bytes = 0;
+  stats.sparse = false;
+  stats.strategy = COPY_REFLINK;
+  string path = checkpointPath(destination);
+  if (checkpoint.offset == 0 && !options.verify && tryReflink(src, dst, stats)) {
+    unlink(path.c_str()); // A leftover from an older copy.
+    stats.seconds = now() - start;
+    return true;
+  }
+  stats.strategy = options.uring_depth > 0 ? COPY_URING : COPY_RANGE;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror("smash error: open failed");
+    return false;
+  }
+  checkpoint.size = src_st.st_size;
+  checkpoint.mtime_sec = src_st.st_mtim.tv_sec;
+  checkpoint.mtime_nsec = src_st.st_mtim.tv_nsec;
+  checkpoint.ino = src_st.st_ino;
+  off_t offset = checkpoint.offset;
+  bool ok = lseek(src, offset, SEEK_SET) != -1 && lseek(dst, offset, SEEK_SET) != -1;
+  if (!ok) {
+    perror("smash error: lseek failed");
+  }
+  while (ok && offset < checkpoint.size) {
+    off_t before = stats.bytes;
+    ok = copyRange(src, dst, std::min<off_t>(RESUME_STEP, checkpoint.size - offset), options, stats);
+    off_t copied = stats.bytes - before;
+    if (!ok || copied == 0) {
+      break; // copied is 0 if the source got shorter under us.
+    }
+    //Read back what we just wrote, it's still in the page cache.
+    uint32_t step_crc = 0;
+    ok = crcRange(dst, offset, copied, checkpoint.crc, step_crc);
+    offset += copied;
+    if (ok) {
+      checkpoint.step = offset - copied;
+      checkpoint.offset = offset;
+      checkpoint.step_crc = step_crc;
+      ok = writeCheckpoint(fd, checkpoint);
+    }
+  }
+  close(fd);
+  if (ok) {
+    unlink(path.c_str());
+  }
+  stats.crc = checkpoint.crc;
+  stats.seconds = now() - start;
+  return ok;
+}
+
+/* cp -r and cp with many files */
+
+struct CopyTask {
+  string source;
+  string destination;
+  int operand; // Which of cp's source operands this file or directory belongs to.
+  bool directory;
+};
+
+/* Copies a set of files and directory trees with a few worker threads. Every worker has its
+own deque of tasks: it pushes and pops at the back (so it goes depth first and stays in the
+directories it just created), and when it runs out it steals from the front of the others',
+where the older tasks, usually whole directories, are. A directory task creates the destination
+directory and pushes a task for each entry, so the walk goes on alongside the copying. */
+class CopyPool {
+  struct Worker {
+    std::mutex lock;
+    std::deque<CopyTask> tasks;
+  };
+  vector<std::unique_ptr<Worker>> workers;
+  std::atomic<long> pending{0}; // Tasks pushed and not yet done. The pool is done when it gets to 0.
+  std::mutex idle_lock;
+  std::condition_variable idle;
+  std::atomic<long> files{0};
+  std::atomic<long long> bytes{0};
+  std::atomic<unsigned> strategies{0}; // A bit for each CopyStrategy that was used.
+  std::atomic<long> sparse{0}; // Files copied extent by extent, keeping their holes.
+  std::atomic<uint32_t> crc{0}; // Of the last file copied, reported when it's the only one.
+  vector<std::atomic<bool>> failed; // Per source operand.
+  CopyOptions options;
+
+  bool pop(int me, CopyTask& task);
+  void work(int me);
+  void copyDirectory(int me, const CopyTask& task);
+  void copyEntry(const CopyTask& task, unsigned char type);
+  void copyFile(const CopyTask& task);
+ public:
+  CopyPool(int operands, const CopyOptions& options) : failed(operands), options(options) {}
+  void push(int me, CopyTask task);
+  void run(int threads);
+  bool hasFailed(int operand) const { return failed[operand]; }
+  void fail(int operand) { failed[operand] = true; }
+  void report(double seconds) const;
+};
+
+void CopyPool::push(int me, CopyTask task) {
+  if (workers.empty()) {
+    workers.emplace_back(new Worker());
+  }
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(workers[me]->lock);
+    workers[me]->tasks.push_back(std::move(task));
+  }
+  idle.notify_one();
+}
+
+bool CopyPool::pop(int me, CopyTask& task) {
+  {
+    Worker& own = *workers[me];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker& victim = *workers[(me + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void CopyPool::work(int me) {
+  while (true) {
+    CopyTask task;
+    if (pop(me, task)) {
+      if (task.directory) {
+        copyDirectory(me, task);
+      } else {
+        copyFile(task);
+      }
+      if (--pending == 0) {
+        idle.notify_all();
+      }
+      continue;
+    }
+    if (pending == 0) {
+      return;
+    }
+    //Someone is still busy and may push more. The timeout covers a push we missed between the check and the wait.
+    std::unique_lock<std::mutex> guard(idle_lock);
+    idle.wait_for(guard, std::chrono::milliseconds(1));
+  }
+}
+
+void CopyPool::run(int threads) {
+  while ((int)workers.size() < threads) {
+    workers.emplace_back(new Worker());
+  }
+  vector<std::thread> helpers;
+  for (int i = 1; i < threads; i++) {
+    helpers.emplace_back(&CopyPool::work, this, i);
+  }
+  work(0);
+  for (std::thread& helper : helpers) {
+    helper.join();
+  }
+}
+
+void CopyPool::copyDirectory(int me, const CopyTask& task) {
+  struct stat st;
+  if (stat(task.source.c_str(), &st) == -1) {
+    perror("smash error: stat failed");
+    fail(task.operand);
+    return;
+  }
+  //The owner keeps write permission, or we couldn't fill a directory copied from a read-only one.
+  if (mkdir(task.destination.c_str(), (st.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST) {
+    perror("smash error: mkdir failed");
+    fail(task.operand);
+    return;
+  }
+  DIR* dir = opendir(task.source.c_str());
+  if (!dir) {
+    perror("smash error: opendir failed");
+    fail(task.operand);
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    CopyTask child{task.source + "/" + entry->d_name, task.destination + "/" + entry->d_name, task.operand, false};
+    unsigned char type = entry->d_type;
+    if (type == DT_UNKNOWN) { // Not every filesystem fills d_type.
+      type = lstat(child.source.c_str(), &st) == 0 ? IFTODT(st.st_mode) : DT_REG;
+    }
+    if (type == DT_DIR) {
+      child.directory = true;
+      push(me, std::move(child));
+    } else if (type == DT_REG) {
+      push(me, std::move(child));
+    } else {
+      copyEntry(child, type); // Symbolic links and such are quick, no need for a task.
+    }
+  }
+  closedir(dir);
+}
+
+void CopyPool::copyEntry(const CopyTask& task, unsigned char type) {
+  if (type != DT_LNK) {
+    cout << "smash error: cp: skipping special file " << task.source << endl;
+    fail(task.operand);
+    return;
+  }
+  char target[PATH_MAX];
+  ssize_t len = readlink(task.source.c_str(), target, sizeof(target) - 1);
+  if (len == -1) {
+    perror("smash error: readlink failed");
+    fail(task.operand);
+    return;
+  }
+  target[len] = '\0';
+  if (symlink(target, task.destination.c_str()) == -1 &&
+      (errno != EEXIST || unlink(task.destination.c_str()) == -1 || symlink(target, task.destination.c_str()) == -1)) {
+    perror("smash error: symlink failed");
+    fail(task.operand);
+    return;
+  }
+  files++;
+}
+
+void CopyPool::copyFile(const CopyTask& task) {
+  int f_source = open(task.source.c_str(), O_RDONLY);
+  if (f_source == -1) {
+    perror("smash error: open failed");
+    fail(task.operand);
+    return;
+  }
+  struct stat st;
+  if (fstat(f_source, &st) == -1) {
+    perror("smash error: fstat failed");
+    close(f_source);
+    fail(task.operand);
+    return;
+  }
+  //Big files get checkpoints if asked for (sparse ones are quick anyway, as only their data is copied).
+  bool resumable = options.checkpoint && S_ISREG(st.st_mode) && st.st_size >= RESUME_MIN && st.st_blocks * 512 >= st.st_size;
+  int f_destination = open(task.destination.c_str(), (options.verify || resumable ? O_RDWR : O_WRONLY) | O_CREAT,
+                           st.st_mode & 07777);
+  if (f_destination == -1) {
+    perror("smash error: open failed");
+    close(f_source);
+    fail(task.operand);
+    return;
+  }
+  bool same = same_file(f_source, f_destination);
+  resumable = resumable && !same;
+  Checkpoint checkpoint;
+  if (resumable && options.resume && readCheckpoint(checkpointPath(task.destination), checkpoint)) {
+    if (usableCheckpoint(checkpoint, st, f_destination)) {
+      cout << "smash: cp: resuming " << task.source << " at byte " << checkpoint.offset << endl;
+    } else {
+      cout << "smash: cp: the checkpoint of " << task.destination << " doesn't match, copying from the start" << endl;
+      checkpoint = Checkpoint();
+    }
+  }
+  /* Only truncate when it's another file, we don't want to delete a file being copied onto itself. */
+  if (!same && checkpoint.offset == 0 && ftruncate(f_destination, 0) == -1) {
+    perror("smash error: ftruncate failed");
+    close(f_destination);
+    close(f_source);
+    fail(task.operand);
+    return;
+  }
+  CopyStats stats;
+  bool ok = resumable ? copyCheckpointed(f_source, f_destination, st, task.destination, checkpoint, options, stats)
+                      : copyData(f_source, f_destination, options, stats);
+  if (!ok) {
+    cout << "smash error: cp: failed to copy " << task.source << endl;
+    fail(task.operand);
+  }
+  crc = stats.crc;
+  close(f_destination);
+  close(f_source);
+  files++;
+  bytes += stats.bytes;
+  strategies |= 1u << stats.strategy;
+  sparse += stats.sparse;
+}
+
+void CopyPool::report(double seconds) const {
+  string used;
+  for (int strategy = COPY_REFLINK; strategy <= COPY_BUFFERED; strategy++) {
+    if (strategies & (1u << strategy)) {
+      used += (used.empty() ? "" : "+") + string(copyStrategyName((CopyStrategy)strategy));
+    }
+  }
+  if (used.empty()) {
+    used = "nothing";
+  }
+  double rate = seconds > 0 ? bytes / seconds : 0;
+  cout << "smash: cp: ";
+  if (files != 1) {
+    cout << files << " files, ";
+  }
+  cout << bytes << " bytes ";
+  if (sparse > 0) {
+    cout << "(holes kept in " << sparse << (sparse == 1 ? " file) " : " files) ");
+  }
+  cout << "using " << used << " in " << std::fixed << std::setprecision(3) << seconds
+       << " s (" << std::setprecision(1) << rate / (1024 * 1024) << " MiB/s)";
+  if (options.verify && files == 1) {
+    cout << ", crc32c " << std::hex << std::setw(8) << std::setfill('0') << crc << std::dec << " verified";
+  } else if (options.verify) {
+    cout << ", verified with crc32c";
+  }
+  cout << endl;
+}
+
+static string baseName(string path) {
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+static string resolved(const string& path) {
+  char buffer[PATH_MAX];
+  return realpath(path.c_str(), buffer) ? string(buffer) : string();
+}
+
+//Whether copying the directory source to destination would put the copy inside the directory itself.
+static bool copiesIntoItself(const string& source, const string& destination) {
+  string from = resolved(source);
+  size_t slash = destination.rfind('/');
+  string parent = resolved(slash == string::npos ? "." : slash == 0 ? "/" : destination.substr(0, slash));
+  if (from.empty() || parent.empty()) {
+    return false;
+  }
+  string to = parent + "/" + baseName(destination);
+  return to == from || to.compare(0, from.size() + 1, from + "/") == 0;
+}
+
+/* cp src dst1 dst2 ... */
+
+/* Copies one file to many destinations, reading it once. The reader fills a ring of FAN_SLOTS
+buffers and a writer thread per destination empties it at its own pace. The reader only refills
+a slot after every writer is done with it, so a slow destination holds the others back only once
+it falls a whole ring behind. */
+class FanOut {
+  struct Slot {
+    char* data;
+    ssize_t len;
+    uint32_t crc;
+  };
+  vector<Slot> ring;
+  std::mutex lock;
+  std::condition_variable filled, drained;
+  long head = 0; // Chunks the reader has put in the ring.
+  bool eof = false;
+  vector<long> tails; // Chunks each writer has written. LONG_MAX once a writer gave up.
+  vector<int> fds;
+  bool verify;
+
+  long slowest();
+  void write(int writer);
+  void giveUp(int writer);
+ public:
+  FanOut(const vector<int>& fds, bool verify);
+  ~FanOut();
+  bool run(int src, off_t& bytes); // Returns false if reading the source failed.
+  bool hasFailed(int writer) const { return tails[writer] == LONG_MAX; }
+};
+
+#define FAN_SLOTS (8)
+#define FAN_CHUNK (1024 * 1024)
+
+FanOut::FanOut(const vector<int>& fds, bool verify) : ring(FAN_SLOTS), tails(fds.size(), 0), fds(fds), verify(verify) {
+  for (Slot& slot : ring) {
+    slot.data = (char*)malloc(FAN_CHUNK);
+  }
+}
+
+FanOut::~FanOut() {
+  for (Slot& slot : ring) {
+    free(slot.data);
+  }
+}
+
+long FanOut::slowest() {
+  return *std::min_element(tails.begin(), tails.end());
+}
+
+void FanOut::giveUp(int writer) {
+  std::lock_guard<std::mutex> guard(lock);
+  tails[writer] = LONG_MAX;
+  drained.notify_one();
+}
+
+void FanOut::write(int writer) {
+  int fd = fds[writer];
+  char* check = verify ? (char*)malloc(FAN_CHUNK) : nullptr;
+  if (verify && !check) {
+    perror("smash error: malloc failed");
+    giveUp(writer);
+    return;
+  }
+  off_t position = 0;
+  while (true) {
+    Slot* slot;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      filled.wait(guard, [&] { return head > tails[writer] || eof; });
+      if (head == tails[writer]) break; // eof, and we wrote everything.
+      slot = &ring[tails[writer] % FAN_SLOTS];
+    }
+    //The slot is ours to read until we move our tail past it, the reader won't touch it before that.
+    ssize_t write_amount = 0;
+    while (write_amount < slot->len) {
+      ssize_t wrote = ::write(fd, slot->data + write_amount, slot->len - write_amount);
+      if (wrote < 0) {
+        if (errno == EINTR) continue;
+        perror("smash error: write failed");
+        free(check);
+        giveUp(writer);
+        return;
+      }
+      write_amount += wrote;
+    }
+    if (verify) {
+      ssize_t got = 0, back;
+      while (got < slot->len && (back = pread(fd, check + got, slot->len - got, position + got)) > 0) {
+        got += back;
+      }
+      if (got != slot->len || crc32c(0, check, got) != slot->crc) {
+        cout << "smash error: cp: verification failed at offset " << position << endl;
+        free(check);
+        giveUp(writer);
+        return;
+      }
+    }
+    position += slot->len;
+    std::lock_guard<std::mutex> guard(lock);
+    tails[writer]++;
+    drained.notify_one();
+  }
+  free(check);
+}
+
+bool FanOut::run(int src, off_t& bytes) {
+  for (Slot& slot : ring) {
+    if (!slot.data) {
+      perror("smash error: malloc failed");
+      return false;
+    }
+  }
+  vector<std::thread> writers;
+  for (size_t i = 0; i < fds.size(); i++) {
+    writers.emplace_back(&FanOut::write, this, i);
+  }
+  posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+  bool ok = true;
+  bytes = 0;
+  for (long chunk = 0; ; chunk++) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      drained.wait(guard, [&] { return slowest() > chunk - FAN_SLOTS; });
+      if (slowest() == LONG_MAX) break; // Every writer gave up, nobody to read for.
+    }
+    Slot& slot = ring[chunk % FAN_SLOTS];
+    do {
+      slot.len = read(src, slot.data, FAN_CHUNK);
+    } while (slot.len == -1 && errno == EINTR);
+    if (slot.len <= 0) {
+      if (slot.len == -1) {
+        perror("smash error: read failed");
+        ok = false;
+      }
+      break;
+    }
+    if (verify) {
+      slot.crc = crc32c(0, slot.data, slot.len);
+    }
+    bytes += slot.len;
+    std::lock_guard<std::mutex> guard(lock);
+    head++;
+    filled.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    eof = true;
+    filled.notify_all();
+  }
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+  return ok;
+}
+
+static int fanOut(const string& source, const vector<string>& destinations, const CopyOptions& options) {
+  double start = now();
+  int f_source = open(source.c_str(), O_RDONLY);
+  if (f_source == -1) {
+    perror("smash error: open failed");
+    return 1;
+  }
+  struct stat st;
+  if (fstat(f_source, &st) == -1) {
+    perror("smash error: fstat failed");
+    close(f_source);
+    return 1;
+  }
+  vector<int> fds;
+  vector<string> targets;
+  int failures = 0;
+  for (const string& destination : destinations) {
+    struct stat dst_st;
+    bool directory = stat(destination.c_str(), &dst_st) == 0 && S_ISDIR(dst_st.st_mode);
+    string target = directory ? destination + "/" + baseName(source) : destination;
+    int fd = open(target.c_str(), (options.verify ? O_RDWR : O_WRONLY) | O_CREAT, st.st_mode & 07777);
+    if (fd == -1) {
+      perror("smash error: open failed");
+      failures++;
+      continue;
+    }
+    /* Only truncate when it's another file, we don't want to delete a file being copied onto itself. */
+    if (same_file(f_source, fd)) {
+      cout << "smash: " << source << " was copied to " << destination << endl; // Nothing to do.
+      close(fd);
+      continue;
+    }
+    if (ftruncate(fd, 0) == -1) {
+      perror("smash error: ftruncate failed");
+      close(fd);
+      failures++;
+      continue;
+    }
+    fds.push_back(fd);
+    targets.push_back(destination);
+  }
+  FanOut fan(fds, options.verify);
+  off_t bytes = 0;
+  bool ok = fds.empty() || fan.run(f_source, bytes);
+  close(f_source);
+  int copied = 0;
+  for (size_t i = 0; i < fds.size(); i++) {
+    close(fds[i]);
+    if (ok && !fan.hasFailed(i)) {
+      cout << "smash: " << source << " was copied to " << targets[i] << endl;
+      copied++;
+    } else {
+      failures++;
+    }
+  }
+  if (copied > 0) {
+    double seconds = now() - start;
+    double rate = seconds > 0 ? bytes / seconds : 0;
+    cout << "smash: cp: " << bytes << " bytes read once for " << copied << (copied == 1 ? " destination" : " destinations") << " in " << std::fixed
+         << std::setprecision(3) << seconds << " s (" << std::setprecision(1) << rate / (1024 * 1024)
+         << " MiB/s)" << (options.verify ? ", verified with crc32c" : "") << endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
+
+int copyHelperMain(int argc, char* argv[]) {
+  /* argv: smash COPY_HELPER_FLAG [-r] [--verify] [--checkpoint] [--resume] [--uring[=depth]] <source>... <directory>
+         or smash COPY_HELPER_FLAG --fanout [--verify] <source> <destination>... */
+  CopyOptions options;
+  bool fan_out = false; // Only when asked for, so a mistyped directory can't overwrite the other operands.
+  int first = 2;
+  for (; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; first++) {
+    if (strcmp(argv[first], "-r") == 0 || strcmp(argv[first], "-R") == 0) {
+      options.recursive = true;
+    } else if (strcmp(argv[first], "--verify") == 0) {
+      options.verify = true;
+    } else if (strcmp(argv[first], "--checkpoint") == 0) {
+      options.checkpoint = true;
+    } else if (strcmp(argv[first], "--resume") == 0) {
+      options.checkpoint = true;
+      options.resume = true;
+    } else if (strcmp(argv[first], "--fanout") == 0) {
+      fan_out = true;
+    } else if (strcmp(argv[first], "--uring") == 0) {
+      options.uring_depth = URING_DEPTH_DEFAULT;
+    } else if (strncmp(argv[first], "--uring=", 8) == 0 && atoi(argv[first] + 8) > 0 &&
+               atoi(argv[first] + 8) <= URING_DEPTH_MAX) {
+      options.uring_depth = atoi(argv[first] + 8);
+    } else {
+      cout << "smash error: cp: invalid arguments" << endl;
+      return 1;
+    }
+  }
+  int operands = argc - first - 1;
+  if (operands < 1) {
+    cout << "smash error: cp: invalid arguments" << endl;
+    return 1;
+  }
+  struct stat st;
+  if (fan_out) { // One file, copied to each of the others.
+    if (stat(argv[first], &st) == 0 && S_ISDIR(st.st_mode)) {
+      cout << "smash error: cp: -r not specified; omitting directory '" << argv[first] << "'" << endl;
+      return 1;
+    }
+    return fanOut(argv[first], vector<string>(argv + first + 1, argv + argc), options);
+  }
+  string destination = argv[argc - 1];
+  bool into_directory = stat(destination.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+  if (operands > 1 && !into_directory) {
+    cout << "smash error: cp: target '" << destination << "' is not a directory" << endl;
+    return 1;
+  }
+
+  double start = now();
+  CopyPool pool(operands, options);
+  int threads = 1;
+  for (int i = 0; i < operands; i++) {
+    string source = argv[first + i];
+    CopyTask task{source, into_directory ? destination + "/" + baseName(source) : destination, i, false};
+    task.directory = stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    if (task.directory && !options.recursive) {
+      cout << "smash error: cp: -r not specified; omitting directory '" << source << "'" << endl;
+      pool.fail(i);
+      continue;
+    }
+    if (task.directory && copiesIntoItself(source, task.destination)) {
+      cout << "smash error: cp: cannot copy a directory, '" << source << "', into itself" << endl;
+      pool.fail(i);
+      continue;
+    }
+    //A single file isn't worth a thread, a directory tree or a handful of files is.
+    threads = task.directory ? COPY_WORKERS_MAX : std::min(threads + (i > 0), COPY_WORKERS_MAX);
+    pool.push(0, std::move(task));
+  }
+  threads = std::max(1, std::min(threads, (int)std::thread::hardware_concurrency()));
+  pool.run(threads);
+
+  int copied = 0;
+  for (int i = 0; i < operands; i++) {
+    if (!pool.hasFailed(i)) {
+      cout << "smash: " << argv[first + i] << " was copied to " << destination << endl;
+      copied++;
+    }
+  }
+  if (copied > 0) {
+    pool.report(now() - start);
+  }
+  return copied == operands ? 0 : 1;
+}
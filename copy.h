@@ -0,0 +1,49 @@
+#ifndef SMASH_COPY_H_
+#define SMASH_COPY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define COPY_HELPER_FLAG "--copy-helper"
+#define URING_DEPTH_DEFAULT (16)
+#define URING_DEPTH_MAX (1024)
+
+/* The ways we know to move a file's contents, from cheapest to most expensive.
+copyData tries them in this order and falls to the next one when the kernel or the
+filesystem can't do the current one (different filesystems, no reflink support...). */
+enum CopyStrategy {
+  COPY_REFLINK,   // FICLONE: the destination shares the source's blocks, nothing is copied.
+  COPY_RANGE,     // copy_file_range: the kernel copies (or lets the filesystem/device do it).
+  COPY_SENDFILE,  // sendfile: in-kernel copy through the page cache.
+  COPY_URING,     // io_uring: our buffers, with many reads and writes in flight at once. Only with --uring.
+  COPY_BUFFERED   // read/write through our own buffer, which grows while reads fill it.
+};
+
+struct CopyOptions {
+  bool recursive = false; // -r
+  bool verify = false; // --verify: read every chunk back from the destination and compare checksums.
+  bool checkpoint = false; // --checkpoint: leave checkpoints while copying a big file, at the cost of reading it back.
+  bool resume = false; // --resume: go on from the checkpoint an interrupted copy of a big file left. Implies --checkpoint.
+  unsigned uring_depth = 0; // --uring[=depth]: chunks in flight with io_uring, 0 to not use it.
+};
+
+struct CopyStats {
+  CopyStrategy strategy = COPY_BUFFERED; // The last strategy used, the one that finished the copy.
+  off_t bytes = 0; // Data bytes, holes in a sparse file not included.
+  bool sparse = false; // Only the data extents were copied, the holes were kept.
+  uint32_t crc = 0; // crc32c of the data copied, with --verify.
+  double seconds = 0;
+};
+
+const char* copyStrategyName(CopyStrategy strategy);
+
+/* Copies src from its offset to the end into dst at its offset. Prints the error and returns false on failure.
+With options.verify, dst must be open for reading as well. */
+bool copyData(int src, int dst, const CopyOptions& options, CopyStats& stats);
+
+// Whether the two descriptors refer to the exact same file on disk.
+bool same_file(int fd1, int fd2);
+
+int copyHelperMain(int argc, char* argv[]); // Entry point of "smash --copy-helper ...", which does the copying for cp.
+
+#endif //SMASH_COPY_H_
@@ -0,0 +1,75 @@
+#include <array>
+#include <string.h>
+#include "crc32c.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY (0x82F63B78u) // Castagnoli, bit reversed.
+
+static constexpr std::array<uint32_t, 256> makeTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+static constexpr std::array<uint32_t, 256> CRC_TABLE = makeTable();
+
+uint32_t crc32cTable(uint32_t crc, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  crc = ~crc;
+  while (len--) {
+    crc = CRC_TABLE[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Compiled for SSE4.2 on its own, so the rest of smash still runs on CPUs without it.
+It's only called after checking the CPU has it. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const void* data, size_t len) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, bytes += 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+#endif
+  for (; len >= 4; len -= 4, bytes += 4) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *bytes++);
+  }
+  return ~crc;
+}
+#endif
+
+typedef uint32_t (*CrcKernel)(uint32_t, const void*, size_t);
+
+static CrcKernel pickKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32cSse42;
+  }
+#endif
+  return crc32cTable;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  static const CrcKernel kernel = pickKernel();
+  return kernel(crc, data, len);
+}
@@ -0,0 +1,14 @@
+#ifndef SMASH_CRC32C_H_
+#define SMASH_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), the checksum cp --verify uses. Chainable: crc32c(crc32c(0, a), b) is the
+crc of a followed by b. Uses the SSE4.2 crc32 instruction when the CPU has it, a table otherwise. */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// The portable version, whatever the CPU supports.
+uint32_t crc32cTable(uint32_t crc, const void* data, size_t len);
+
+#endif //SMASH_CRC32C_H_
@@ -0,0 +1,51 @@
+#include <errno.h>
+#include <signal.h>
+#include "launcher.h"
+
+extern char** environ;
+
+Launcher::Launcher() : flags(0) {
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+  /* The shell catches these, the children should get the default behaviour back,
+  and start with nothing blocked, whatever the shell is blocking at the moment. */
+  sigset_t defaults, mask;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGTSTP);
+  sigaddset(&defaults, SIGALRM);
+  sigemptyset(&mask);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+}
+
+Launcher::~Launcher() {
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+}
+
+void Launcher::setProcessGroup(pid_t pgid) {
+  posix_spawnattr_setpgroup(&attr, pgid);
+  flags |= POSIX_SPAWN_SETPGROUP;
+}
+
+void Launcher::redirect(int fd, int target_fd) {
+  posix_spawn_file_actions_adddup2(&actions, fd, target_fd);
+}
+
+void Launcher::close(int fd) {
+  posix_spawn_file_actions_addclose(&actions, fd);
+}
+
+pid_t Launcher::spawn(const char* path, char* const argv[], bool search_path) {
+  pid_t pid;
+  posix_spawnattr_setflags(&attr, flags);
+  int res = search_path ? posix_spawnp(&pid, path, &actions, &attr, argv, environ)
+                        : posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  if (res != 0) { // posix_spawn returns the error instead of setting errno.
+    errno = res;
+    return -1;
+  }
+  return pid;
+}
@@ -0,0 +1,27 @@
+#ifndef SMASH_LAUNCHER_H_
+#define SMASH_LAUNCHER_H_
+
+#include <spawn.h>
+#include <sys/types.h>
+
+/* Starts child processes with posix_spawn instead of fork().
+posix_spawn runs the child on the parent's address space until it execs (CLONE_VM|CLONE_VFORK in glibc),
+so no page tables are copied and the launch cost does not grow with the shell's memory.
+Whatever a forked child used to do before exec (setpgrp, dup2, close, resetting signals) is recorded here
+as a spawn attribute or file action. */
+class Launcher {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  short flags;
+ public:
+  Launcher();
+  ~Launcher();
+  Launcher(Launcher const&) = delete;
+  void operator=(Launcher const&) = delete;
+  void setProcessGroup(pid_t pgid); // 0 means a new group led by the child, like setpgrp().
+  void redirect(int fd, int target_fd); // dup2(fd, target_fd) in the child.
+  void close(int fd);
+  pid_t spawn(const char* path, char* const argv[], bool search_path = false); // returns -1 and sets errno on failure.
+};
+
+#endif //SMASH_LAUNCHER_H_
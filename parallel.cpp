@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include "parallel.h"
+#include "launcher.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+#define PARALLEL_PLACEHOLDER "{}"
+#define PARALLEL_SHELL_CHARS "|&;<>()$`\\\"'*?[]#~" // A template with any of these needs bash.
+
+/* parallel helper start */
+
+/* Every item's stdout and stderr go to memfds of their own, so an item never waits for us to drain a pipe,
+and whole outputs can be written out in input order once an item is done. */
+struct Item {
+  pid_t pid = -1;
+  int out = -1;
+  int err = -1;
+  bool done = false;
+};
+
+static bool readItems(int fd, vector<string>& items) {
+  string input;
+  char buffer[65536];
+  ssize_t num;
+  while ((num = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (num == -1) {
+      if (errno == EINTR) continue;
+      perror("smash error: read failed");
+      return false;
+    }
+    input.append(buffer, num);
+  }
+  size_t start = 0;
+  while (start < input.size()) {
+    size_t end = input.find('\n', start);
+    if (end == string::npos) end = input.size();
+    if (end > start) { // Empty lines are no items.
+      items.emplace_back(input, start, end - start);
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+static string replaceAll(const string& text, const string& with) {
+  string result;
+  size_t start = 0, found;
+  while ((found = text.find(PARALLEL_PLACEHOLDER, start)) != string::npos) {
+    result.append(text, start, found - start).append(with);
+    start = found + strlen(PARALLEL_PLACEHOLDER);
+  }
+  return result.append(text, start, string::npos);
+}
+
+static string shellQuote(const string& text) {
+  if (!text.empty() && text.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_./,:@%+=-") == string::npos) {
+    return text; // Nothing bash would touch, and it can still be a number in $((...)).
+  }
+  string quoted = "'";
+  for (char c : text) {
+    quoted += c == '\'' ? string("'\\''") : string(1, c);
+  }
+  return quoted + "'";
+}
+
+static void writeOutput(int fd, int target) {
+  //The item moved the shared file offset while writing, so read with our own, from the start.
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return;
+  }
+  off_t offset = 0;
+  while (offset < st.st_size) {
+    ssize_t num = sendfile(target, fd, &offset, st.st_size - offset);
+    if (num > 0) continue;
+    if (num == -1 && errno == EINTR) continue;
+    char buffer[65536]; // sendfile can't write there (or gave up), do it ourselves.
+    num = pread(fd, buffer, std::min<off_t>(sizeof(buffer), st.st_size - offset), offset);
+    if (num <= 0 || write(target, buffer, num) != num) {
+      return;
+    }
+    offset += num;
+  }
+}
+
+/* The template is either several words, the item's argv as they are (parallel sh -c "sleep 1" {}),
+or a single word holding a command line (parallel 'grep x {} | wc -l'), which is split on blanks,
+or given to bash as it is when it needs it. */
+class Runner {
+  vector<string> words; // Each {} in a word becomes the item, in one argument.
+  string line; // The single word template as bash gets it, empty for argv words.
+  bool shell = false; // The line needs bash (pipes, redirections, quotes...).
+  int null_fd; // The items' stdin, when the items come from ours.
+ public:
+  Runner(const vector<string>& text, int null_fd) : words(text), null_fd(null_fd) {
+    if (words.size() == 1 && words[0].find_first_of(" \t" PARALLEL_SHELL_CHARS) != string::npos) {
+      line = words[0];
+      words.clear();
+      if (line.find(PARALLEL_PLACEHOLDER) == string::npos) {
+        line += " " PARALLEL_PLACEHOLDER; // Like xargs, the item goes last.
+      }
+      shell = line.find_first_of(PARALLEL_SHELL_CHARS) != string::npos;
+      size_t start = line.find_first_not_of(" \t");
+      while (start != string::npos) {
+        size_t end = line.find_first_of(" \t", start);
+        words.push_back(line.substr(start, end == string::npos ? string::npos : end - start));
+        start = end == string::npos ? end : line.find_first_not_of(" \t", end);
+      }
+    } else if (std::none_of(words.begin(), words.end(), [](const string& word) {
+                 return word.find(PARALLEL_PLACEHOLDER) != string::npos; })) {
+      words.push_back(PARALLEL_PLACEHOLDER);
+    }
+  }
+
+  pid_t start(const string& item, Item& output) {
+    output.out = memfd_create("smash-parallel-out", MFD_CLOEXEC);
+    output.err = memfd_create("smash-parallel-err", MFD_CLOEXEC);
+    if (output.out == -1 || output.err == -1) {
+      perror("smash error: memfd_create failed");
+      return -1;
+    }
+    Launcher launcher; // Same process group as the helper, so signals for the job reach every item.
+    launcher.redirect(output.out, STDOUT_FILENO);
+    launcher.redirect(output.err, STDERR_FILENO);
+    if (null_fd != -1) {
+      launcher.redirect(null_fd, STDIN_FILENO);
+    }
+    if (!shell) {
+      vector<string> args;
+      for (const string& word : words) {
+        args.push_back(replaceAll(word, item));
+      }
+      vector<char*> argv;
+      for (string& arg : args) {
+        argv.push_back(&arg[0]);
+      }
+      argv.push_back(nullptr);
+      pid_t pid = launcher.spawn(argv[0], argv.data(), true);
+      if (pid != -1) {
+        return pid;
+      }
+    }
+    //Not found (maybe it's a bash builtin), or not a plain command: bash runs it, and reports the errors like for any command.
+    string expanded;
+    if (!line.empty()) {
+      expanded = replaceAll(line, shellQuote(item));
+    } else {
+      for (const string& word : words) { // Quoted one by one, so bash sees the same words we would have exec'd.
+        expanded.append(expanded.empty() ? "" : " ").append(shellQuote(replaceAll(word, item)));
+      }
+    }
+    const char* const bash_args[] = {"/bin/bash", "-c", expanded.c_str(), nullptr};
+    pid_t pid = launcher.spawn("/bin/bash", const_cast<char* const*>(bash_args));
+    if (pid == -1) {
+      perror("smash error: posix_spawn failed");
+    }
+    return pid;
+  }
+};
+
+int parallelHelperMain(int argc, char* argv[]) {
+  /* argv: smash PARALLEL_HELPER_FLAG [--progress] [-j jobs] [-a file] template... */
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* path = nullptr;
+  ParallelProgress* progress = nullptr;
+  int first = 2;
+  for (; first < argc && argv[first][0] == '-'; first++) {
+    if (strcmp(argv[first], "--progress") == 0) {
+      void* shared = mmap(nullptr, sizeof(ParallelProgress), PROT_READ | PROT_WRITE, MAP_SHARED, PARALLEL_PROGRESS_FD, 0);
+      close(PARALLEL_PROGRESS_FD);
+      progress = shared == MAP_FAILED ? nullptr : static_cast<ParallelProgress*>(shared);
+    } else if (strncmp(argv[first], "-j", 2) == 0) {
+      const char* value = argv[first][2] ? argv[first] + 2 : (first + 1 < argc ? argv[++first] : "");
+      char* end;
+      jobs = strtol(value, &end, 10);
+      if (end == value || *end != '\0' || jobs < 1 || jobs > PARALLEL_JOBS_MAX) {
+        cout << "smash error: parallel: invalid arguments" << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[first], "-a") == 0 && first + 1 < argc) {
+      path = argv[++first];
+    } else {
+      cout << "smash error: parallel: invalid arguments" << endl;
+      return 1;
+    }
+  }
+  if (first == argc) {
+    cout << "smash error: parallel: invalid arguments" << endl;
+    return 1;
+  }
+  vector<string> text(argv + first, argv + argc);
+
+  int input = STDIN_FILENO;
+  if (path && (input = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    perror("smash error: open failed");
+    return 1;
+  }
+  vector<string> items;
+  if (!readItems(input, items)) {
+    return 1;
+  }
+  int null_fd = -1;
+  if (!path) { // Our stdin was the items, theirs is empty.
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  } else {
+    close(input);
+  }
+  if (progress) {
+    progress->total.store(items.size(), std::memory_order_relaxed);
+  }
+  //Two memfds for each item that ran and wasn't written out yet.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  /* Up to jobs items run at once. An item done ahead of an earlier one that still runs waits for it,
+  with no more than window items between the first not written out and the last started. */
+  Runner runner(text, null_fd);
+  vector<Item> outputs(items.size());
+  size_t window = 2 * jobs, next = 0, flushed = 0, running = 0;
+  int failures = 0;
+  while (flushed < items.size()) {
+    while (running < (size_t)jobs && next < items.size() && next < flushed + window) {
+      Item& item = outputs[next];
+      item.pid = runner.start(items[next], item);
+      if (item.pid == -1) {
+        item.done = true;
+        failures++;
+      } else {
+        running++;
+      }
+      next++;
+    }
+    if (running > 0) {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0); // Each item is reaped as soon as it's done.
+      if (pid == -1) {
+        if (errno == EINTR) continue;
+        perror("smash error: waitpid failed");
+        return 1;
+      }
+      auto found = std::find_if(outputs.begin() + flushed, outputs.begin() + next, [pid](const Item& item) {
+        return item.pid == pid && !item.done;
+      });
+      if (found == outputs.begin() + next) {
+        continue;
+      }
+      found->done = true;
+      running--;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failures++;
+      }
+      if (progress) {
+        progress->done.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    for (; flushed < next && outputs[flushed].done; flushed++) {
+      Item& item = outputs[flushed];
+      if (item.out != -1) {
+        writeOutput(item.out, STDOUT_FILENO);
+        close(item.out);
+      }
+      if (item.err != -1) {
+        writeOutput(item.err, STDERR_FILENO);
+        close(item.err);
+      }
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+/* parallel helper end */
@@ -0,0 +1,20 @@
+#ifndef SMASH_PARALLEL_H_
+#define SMASH_PARALLEL_H_
+
+#include <atomic>
+#include <stdint.h>
+
+#define PARALLEL_HELPER_FLAG "--parallel-helper"
+#define PARALLEL_PROGRESS_FD (3) // Where the helper finds the progress memfd, if the shell gave it one.
+#define PARALLEL_JOBS_MAX (1024)
+
+/* Lives in a memfd mapped by both the shell and the helper, so jobs can show how far a parallel got
+without asking it. Only the helper writes. */
+struct ParallelProgress {
+  std::atomic<uint32_t> done;
+  std::atomic<uint32_t> total;
+};
+
+int parallelHelperMain(int argc, char* argv[]); // Entry point of "smash --parallel-helper ...", which runs parallel's items.
+
+#endif //SMASH_PARALLEL_H_
@@ -0,0 +1,164 @@
+#include <string.h>
+#include "parser.h"
+
+using std::size_t;
+using std::string_view;
+
+static const char* const WHITESPACE_CHARS = " \n\r\t\f\v";
+
+static bool _isSpace(char c) {
+  return strchr(WHITESPACE_CHARS, c) != nullptr && c != '\0';
+}
+
+void ParsedLine::clear() {
+  words.clear();
+  stages.clear();
+  redirect = false;
+  append = false;
+  target = {};
+  background = false;
+  valid = true;
+  text = string_view();
+}
+
+string_view ParsedLine::textFrom(size_t word, string_view until) const {
+  const char* start = words[word].text.data();
+  return string_view(start, until.data() + until.size() - start);
+}
+
+void parseLine(string_view line, ParsedLine& out) {
+  out.clear();
+  /* A & is the background sign only when it is the last thing on the line (a&b is just a word, like bash's
+  tokenizer would not have it but like smash always had it), so find where the line really ends up front. */
+  size_t last = line.find_last_not_of(WHITESPACE_CHARS);
+  size_t n = (last == string_view::npos) ? 0 : last + 1;
+  ParsedLine::Stage stage = {0, 0, false, string_view()};
+  bool expect_target = false, stage_open = true;
+
+  auto closeStage = [&](bool pipe_stderr) {
+    if (stage.count == 0) {
+      out.valid = false; // "| cmd", "cmd | | cmd", "> file"...
+      return;
+    }
+    stage.pipe_stderr = pipe_stderr;
+    stage.text = out.textFrom(stage.first, out.words[stage.first + stage.count - 1].text);
+    out.stages.push_back(stage);
+    stage = {out.words.size(), 0, false, string_view()};
+  };
+
+  size_t i = 0;
+  while (i < n) {
+    char c = line[i];
+    if (_isSpace(c)) {
+      ++i;
+    } else if (c == '|') {
+      if (!stage_open) {
+        out.valid = false; // We only support a redirection at the end of the line.
+      }
+      bool pipe_stderr = i + 1 < n && line[i + 1] == '&';
+      closeStage(pipe_stderr);
+      i += pipe_stderr ? 2 : 1;
+    } else if (c == '>') {
+      if (!stage_open) {
+        out.valid = false; // Two redirections.
+      }
+      closeStage(false);
+      stage_open = false;
+      expect_target = true;
+      out.redirect = true;
+      out.append = i + 1 < n && line[i + 1] == '>';
+      i += out.append ? 2 : 1;
+    } else if (c == '&' && i == n - 1) {
+      out.background = true;
+      ++i;
+    } else { // A word. Runs until an unquoted space or operator.
+      size_t start = i;
+      bool quoted = false;
+      char quote = 0;
+      for (; i < n; ++i) {
+        c = line[i];
+        if (quote) {
+          if (c == quote) {
+            quote = 0;
+          } else if (c == '\\' && quote == '"' && i + 1 < n) {
+            ++i;
+          }
+        } else if (c == '\'' || c == '"') {
+          quote = c;
+          quoted = true;
+        } else if (c == '\\' && i + 1 < n) {
+          ++i;
+          quoted = true;
+        } else if (_isSpace(c) || c == '|' || c == '>' || (c == '&' && i == n - 1)) {
+          break;
+        }
+      }
+      if (quote) {
+        out.valid = false; // Unterminated quote, bash will tell the user about it.
+      }
+      ParsedLine::Word word = {line.substr(start, i - start), quoted};
+      if (expect_target) {
+        out.target = word;
+        expect_target = false;
+      } else if (!stage_open) {
+        out.valid = false; // Words after the redirection target.
+      } else {
+        out.words.push_back(word);
+        ++stage.count;
+      }
+    }
+  }
+
+  if (out.words.empty()) { // Empty line (maybe just "&").
+    out.stages.clear();
+    return;
+  }
+  if (stage_open) {
+    closeStage(false);
+  }
+  if (expect_target) {
+    out.valid = false; // "cmd >" with no file.
+  }
+  if (!out.valid) { // Hand the line as typed to bash, operators included.
+    size_t start = line.find_first_not_of(WHITESPACE_CHARS);
+    size_t end = out.background ? line.find_last_not_of(WHITESPACE_CHARS, n - 2) + 1 : n;
+    out.text = line.substr(start, end - start);
+    return;
+  }
+  out.text = out.textFrom(0, out.redirect ? out.target.text : out.words.back().text);
+}
+
+size_t unquote(const ParsedLine::Word& word, char* out) {
+  size_t len = 0;
+  if (!word.quoted) {
+    len = word.text.size();
+    memcpy(out, word.text.data(), len);
+    out[len] = '\0';
+    return len;
+  }
+  char quote = 0;
+  const string_view& text = word.text;
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    if (quote == '\'') {
+      if (c == '\'') quote = 0;
+      else out[len++] = c;
+    } else if (quote == '"') {
+      if (c == '"') {
+        quote = 0;
+      } else if (c == '\\' && i + 1 < text.size() && strchr("\"\\$`", text[i + 1])) {
+        out[len++] = text[++i];
+      } else {
+        out[len++] = c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+    } else if (c == '\\' && i + 1 < text.size()) {
+      out[len++] = text[++i];
+    } else {
+      out[len++] = c;
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
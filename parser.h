@@ -0,0 +1,47 @@
+#ifndef SMASH_PARSER_H_
+#define SMASH_PARSER_H_
+
+#include <cstddef>
+#include <string_view>
+#include "smallvector.h"
+
+#define INLINE_WORDS (20) // Lines with more words than this keep them on the heap.
+#define INLINE_STAGES (4)
+
+/* The structure of one input line: a pipeline of one or more stages, an optional output redirection
+and an optional background sign. Everything points into the line itself, nothing is copied. */
+struct ParsedLine {
+  struct Word {
+    std::string_view text; // As typed, quotes included.
+    bool quoted; // Has quotes or backslashes, so its value (see unquote) differs from text.
+  };
+
+  struct Stage {
+    std::size_t first; // Index of the stage's first word in words.
+    std::size_t count;
+    bool pipe_stderr; // The stage is followed by |& rather than |.
+    std::string_view text;
+  };
+
+  SmallVector<Word, INLINE_WORDS> words;
+  SmallVector<Stage, INLINE_STAGES> stages;
+  bool redirect = false;
+  bool append = false; // >> rather than >.
+  Word target = {};
+  bool background = false;
+  bool valid = true; // false for lines we can't represent (a pipe after a redirection, unclosed quotes...).
+  std::string_view text; // The whole line without surrounding spaces and the background sign.
+
+  void clear();
+  std::string_view textFrom(std::size_t word, std::string_view until) const; // From a word to the end of the until view.
+};
+
+/* Splits the line into words and operators (|, |&, >, >>, and a trailing &) in one pass,
+honouring quotes and backslashes, and fills out. */
+void parseLine(std::string_view line, ParsedLine& out);
+
+/* Writes the value of word (quotes removed, escapes resolved) to out, which must have room for
+word.text.size() + 1 chars. Returns the length written, without the null terminator. */
+std::size_t unquote(const ParsedLine::Word& word, char* out);
+
+#endif //SMASH_PARSER_H_
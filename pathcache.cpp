@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "pathcache.h"
+
+using std::string;
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                   IN_DELETE_SELF | IN_MOVE_SELF;
+
+void PathCache::init() {
+  initialized = true;
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    perror("smash error: inotify_init1 failed"); // Not fatal, we just won't cache anything.
+  }
+  const char* path = getenv("PATH");
+  string path_str = path ? path : "";
+  size_t start = 0;
+  while (start <= path_str.size()) {
+    size_t end = path_str.find(':', start);
+    if (end == string::npos) end = path_str.size();
+    string dir = path_str.substr(start, end - start);
+    if (dir.empty()) {
+      dir = "."; // An empty entry means the current directory.
+    }
+    dirs.push_back(dir);
+    // Directories that don't exist (and relative ones) can't be watched, we just don't cache from them.
+    watched.push_back(inotify_fd != -1 && dir[0] == '/' &&
+                      inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK | IN_ONLYDIR) != -1);
+    start = end + 1;
+  }
+}
+
+PathCache::~PathCache() {
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+  }
+}
+
+void PathCache::readEvents() {
+  /* Any change to a name in one of the $PATH directories may change where that name resolves to
+  (a new file earlier in $PATH, a removed or renamed one...), so just forget it. */
+  if (inotify_fd == -1) {
+    return;
+  }
+  alignas(struct inotify_event) char buffer[4096];
+  while (true) {
+    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      return; // EAGAIN: nothing changed.
+    }
+    for (char* pos = buffer; pos < buffer + len; ) {
+      struct inotify_event* event = reinterpret_cast<struct inotify_event*>(pos);
+      if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        entries.clear(); // Lost track of something, start over.
+      } else if (event->len > 0) {
+        entries.erase(event->name);
+      }
+      pos += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+const char* PathCache::lookup(const char* name) {
+  if (!initialized) {
+    init();
+  }
+  readEvents();
+  auto it = entries.find(name);
+  if (it != entries.end()) {
+    ++hits;
+    ++it->second.hits;
+    return it->second.path.c_str();
+  }
+  ++misses;
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    string candidate = dirs[i] + "/" + name;
+    struct stat st;
+    if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+      if (!watched[i]) { // Nothing would tell us when this goes stale.
+        uncached = candidate;
+        return uncached.c_str();
+      }
+      Entry& entry = entries[name];
+      entry.path = candidate;
+      entry.hits = 1;
+      return entry.path.c_str();
+    }
+  }
+  return nullptr;
+}
+
+void PathCache::reset() {
+  readEvents();
+  entries.clear();
+  hits = 0;
+  misses = 0;
+}
@@ -0,0 +1,47 @@
+#ifndef SMASH_PATHCACHE_H_
+#define SMASH_PATHCACHE_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Remembers where in $PATH each command was found, so launching the same program again
+doesn't walk $PATH with a stat per directory. The $PATH directories are watched with inotify,
+and a change to a name in any of them drops that name from the cache. */
+class PathCache {
+ public:
+  struct Entry {
+    std::string path;
+    unsigned hits; // Launches of this command, the first (missed) one included, like bash's hash.
+  };
+ private:
+  std::unordered_map<std::string, Entry> entries;
+  std::vector<std::string> dirs; // The directories of $PATH, in order.
+  std::vector<bool> watched; // Whether dirs[i] is watched. Only what we find in watched directories is cached.
+  std::string uncached; // Result of the last lookup that could not be cached.
+  int inotify_fd = -1;
+  bool initialized = false;
+  unsigned long hits = 0;
+  unsigned long misses = 0;
+  void init();
+  void readEvents();
+ public:
+  PathCache() = default;
+  ~PathCache();
+  PathCache(PathCache const&) = delete;
+  void operator=(PathCache const&) = delete;
+  const char* lookup(const char* name); // The absolute path of name, nullptr if it is not in $PATH.
+  void reset();
+  const std::unordered_map<std::string, Entry>& getEntries() {
+    readEvents();
+    return entries;
+  }
+  unsigned long getHits() const {
+    return hits;
+  }
+  unsigned long getMisses() const {
+    return misses;
+  }
+};
+
+#endif //SMASH_PATHCACHE_H_
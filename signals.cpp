@@ -5,25 +5,29 @@
 
 using namespace std;
 
+/* These run from the shell's event loop (SmallShell::waitForEvents), which reads the signals from a signalfd.
+So they are not signal handlers anymore, and are free to print and to touch the shell's state. */
+
 void ctrlZHandler(int sig_num) {
   SmallShell& smash = SmallShell::getInstance();
   cout << "smash: got ctrl-Z" << endl;
   pid_t pid = smash.getForegroundPid();
   if (pid != -1) {
     // Then there is a process running in the foreground.
-    if (kill(pid, SIGSTOP) == -1) {
+    if (smash.signalForeground(SIGSTOP) == -1) {
       perror("smash error: kill failed");
     } else {
       cout << "smash: process " << pid << " was stopped" << endl;
     }
   }
-  pid_t pid2 = smash.getPipedForegroundPid();
-  if (pid2 != -1) {
-    // Then there is a process running in the foreground.
-    if (kill(pid2, SIGSTOP) == -1) {
+  JobEntry* group = smash.getForegroundGroup();
+  if (group) { // A pipe. One signal to its process group reaches all the stages.
+    if (group->sendSignal(SIGSTOP) == -1) {
       perror("smash error: kill failed");
     } else {
-      cout << "smash: process " << pid2 << " was stopped" << endl;
+      for (pid_t pid2 : group->members) {
+        cout << "smash: process " << pid2 << " was stopped" << endl;
+      }
     }
   }
 }
@@ -34,25 +38,30 @@ void ctrlCHandler(int sig_num) {
   pid_t pid = smash.getForegroundPid();
   if (pid != -1) {
     // Then there is a process running in the foreground.
-    if (kill(pid, SIGKILL) == -1) {
+    if (smash.signalForeground(SIGKILL) == -1) {
       perror("smash error: kill failed");
     } else {// Kill it.
       cout << "smash: process " << pid << " was killed" << endl;
       smash.removeTimeout(pid); 
     }
   }
-  pid_t pid2 = smash.getPipedForegroundPid();
-  if (pid2 != -1) { //The second command in the pipe
-    if (kill(pid2, SIGKILL) == -1) {
+  JobEntry* group = smash.getForegroundGroup();
+  if (group) { // A pipe. One signal to its process group reaches all the stages.
+    if (group->sendSignal(SIGKILL) == -1) {
       perror("smash error: kill failed");
-    } else {// Kill it.
-      cout << "smash: process " << pid2 << " was killed" << endl;
+    } else {
+      for (pid_t pid2 : group->members) {
+        cout << "smash: process " << pid2 << " was killed" << endl;
+      }
     }
   }
 }
 
 void alarmHandler(int sig_num) {
-  cout << "smash: got an alarm" << endl;
-  SmallShell& smash = SmallShell::getInstance();
-  smash.handleAlarms();
+  SmallShell::getInstance().handleAlarms();
+}
+
+void childHandler(int sig_num) {
+  //The jobs list reaps before the next command (see JobsList::removeFinishedJobs), and foreground waits check on their own.
+  SmallShell::getInstance().childChanged();
 }
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef SMASH_SMALLVECTOR_H_
+#define SMASH_SMALLVECTOR_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+/* A vector that keeps its first N elements inline and only goes to the heap when it grows past them.
+Growth doubles the capacity, so even a line with 100k words reallocates only ~13 times.
+Only for trivially copyable element types (words, stages...), which lets growing be a plain memcpy/realloc. */
+template <typename T, std::size_t N>
+class SmallVector {
+  static_assert(std::is_trivially_copyable<T>::value, "SmallVector elements are moved with memcpy");
+  T* data_;
+  std::size_t size_ = 0;
+  std::size_t capacity_ = N;
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type inline_[N];
+
+  bool onHeap() const {
+    return data_ != reinterpret_cast<const T*>(inline_);
+  }
+  void grow() {
+    std::size_t capacity = capacity_ * 2;
+    T* data = static_cast<T*>(onHeap() ? realloc(data_, capacity * sizeof(T)) : malloc(capacity * sizeof(T)));
+    if (!data) {
+      throw std::bad_alloc();
+    }
+    if (!onHeap()) {
+      memcpy(static_cast<void*>(data), inline_, size_ * sizeof(T));
+    }
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+ public:
+  SmallVector() : data_(reinterpret_cast<T*>(inline_)) {}
+  ~SmallVector() {
+    if (onHeap()) free(data_);
+  }
+  SmallVector(SmallVector const&) = delete;
+  void operator=(SmallVector const&) = delete;
+
+  void push_back(const T& value) {
+    if (size_ == capacity_) grow();
+    data_[size_++] = value;
+  }
+  void clear() { // Keeps the capacity, so the next line of the same size doesn't allocate.
+    size_ = 0;
+  }
+  std::size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return size_ == 0;
+  }
+  T& operator[](std::size_t i) {
+    return data_[i];
+  }
+  const T& operator[](std::size_t i) const {
+    return data_[i];
+  }
+  T& back() {
+    return data_[size_ - 1];
+  }
+  const T& back() const {
+    return data_[size_ - 1];
+  }
+  T* begin() {
+    return data_;
+  }
+  T* end() {
+    return data_ + size_;
+  }
+  const T* begin() const {
+    return data_;
+  }
+  const T* end() const {
+    return data_ + size_;
+  }
+};
+
+#endif //SMASH_SMALLVECTOR_H_
@@ -7,28 +7,26 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include "Commands.h"
+#include "copy.h"
+#include "parallel.h"
 #include "signals.h"
 
 
 int main(int argc, char* argv[]) {
-    if (signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-Z handler");
+    if (argc > 1 && strcmp(argv[1], COPY_HELPER_FLAG) == 0) {
+        return copyHelperMain(argc, argv);
     }
-    if (signal(SIGINT , ctrlCHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
+    if (argc > 1 && strcmp(argv[1], PARALLEL_HELPER_FLAG) == 0) {
+        return parallelHelperMain(argc, argv);
     }
-    struct sigaction sa;
-    sa.sa_flags = SA_RESTART;
-    sa.sa_handler = alarmHandler;
-    if (sigaction(SIGALRM, &sa, NULL) == -1) {
-        perror("smash error: sigaction failed");
-    }
-    
     SmallShell& smash = SmallShell::getInstance();
+    smash.initEvents(); // ctrl-C, ctrl-Z, children and alarms are handled by the event loop from here on.
+    std::string cmd_line;
     while(true) {
-        std::cout << smash.getPromptName() << "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
+        std::cout << smash.getPromptName() << "> " << std::flush;
+        if (!smash.readLine(cmd_line)) {
+            break; // End of input.
+        }
         smash.executeCommand(cmd_line.c_str());
     }
     return 0;
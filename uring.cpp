@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+Uring::Uring(unsigned depth) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd == -1) {
+    return;
+  }
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  //Newer kernels map both rings with one mmap.
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size = cq_ring_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                 IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    sq_ring = nullptr;
+    close(ring_fd);
+    return;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                   IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      cq_ring = nullptr;
+      close(ring_fd);
+      return;
+    }
+  }
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQES);
+  if (sqes_map == MAP_FAILED) {
+    close(ring_fd);
+    return;
+  }
+  sqes = (io_uring_sqe*)sqes_map;
+  char* sq = (char*)sq_ring;
+  char* cq = (char*)cq_ring;
+  sq_head = (unsigned*)(sq + params.sq_off.head);
+  sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + params.sq_off.array);
+  cq_head = (unsigned*)(cq + params.cq_off.head);
+  cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+  entries = params.sq_entries;
+  features = params.features;
+  fd = ring_fd;
+}
+
+Uring::~Uring() {
+  int error = errno; // Keep the reason we gave up for whoever checks it after we're gone.
+  if (sqes) munmap(sqes, sqes_size);
+  if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+  if (sq_ring) munmap(sq_ring, sq_ring_size);
+  if (fd != -1) close(fd);
+  errno = error;
+}
+
+io_uring_sqe* Uring::next() {
+  unsigned tail = *sq_tail + pending;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) {
+    return nullptr;
+  }
+  unsigned index = tail & *sq_mask;
+  sq_array[index] = index;
+  pending++;
+  io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void Uring::prepare(io_uring_sqe* sqe, uint8_t opcode, int target, void* buffer, unsigned len, uint64_t offset,
+                    uint64_t user_data) {
+  sqe->opcode = opcode;
+  sqe->fd = target;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+int Uring::submit(unsigned wait_for) {
+  //Publish the new tail only after the sqes themselves are written.
+  __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+  unsigned to_submit = pending;
+  pending = 0;
+  while (true) {
+    int submitted = syscall(__NR_io_uring_enter, fd, to_submit, wait_for,
+                            wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (submitted >= 0 || errno != EINTR) {
+      return submitted < 0 ? -1 : 0;
+    }
+    to_submit = 0; // Interrupted while waiting, the sqes were already taken.
+  }
+}
+
+bool Uring::reap(io_uring_cqe& cqe) {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  cqe = cqes[head & *cq_mask];
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* UringSink start */
+
+static UringSink* active_sink = nullptr; // quit exits in the middle of a builtin, it must not lose the output.
+
+UringSink::UringSink(int target) : target(target), ring(2) {
+  use_ring = ring.ok() && ring.has(IORING_FEAT_RW_CUR_POS);
+  static bool registered = false;
+  if (!registered) {
+    atexit([] {
+      if (active_sink) active_sink->finish();
+    });
+    registered = true;
+  }
+  active_sink = this;
+  setp(buffers[current], buffers[current] + SINK_BUFFER);
+}
+
+UringSink::~UringSink() {
+  finish();
+  if (active_sink == this) {
+    active_sink = nullptr;
+  }
+}
+
+bool UringSink::send(const char* data, size_t len) {
+  io_uring_sqe* sqe = ring.next(); // Never full, there's one write at a time.
+  ring.prepare(sqe, IORING_OP_WRITE, target, const_cast<char*>(data), len, (uint64_t)-1, 0); // -1: at the file position.
+  if (ring.submit(0) == -1) {
+    perror("smash error: io_uring_enter failed");
+    return false;
+  }
+  flight = data;
+  flight_left = len;
+  return true;
+}
+
+bool UringSink::complete() {
+  while (flight_left > 0) {
+    io_uring_cqe cqe;
+    while (!ring.reap(cqe)) {
+      if (ring.submit(1) == -1) {
+        perror("smash error: io_uring_enter failed");
+        flight_left = 0;
+        return false;
+      }
+    }
+    if (cqe.res <= 0) {
+      errno = cqe.res < 0 ? -cqe.res : EIO;
+      perror("smash error: write failed");
+      flight_left = 0;
+      return false;
+    }
+    flight += cqe.res;
+    flight_left -= cqe.res;
+    if (flight_left > 0 && !send(flight, flight_left)) { // A short write, the rest goes again.
+      flight_left = 0;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool UringSink::flushBuffer() {
+  size_t len = pptr() - pbase();
+  bool ok = !failed;
+  if (len > 0 && ok && !use_ring) {
+    for (size_t done = 0; ok && done < len;) {
+      ssize_t wrote = write(target, pbase() + done, len - done);
+      if (wrote == -1 && errno == EINTR) continue;
+      if (wrote <= 0) {
+        perror("smash error: write failed");
+        ok = false;
+      } else {
+        done += wrote;
+      }
+    }
+  } else if (len > 0 && ok) {
+    ok = complete() && send(pbase(), len); // The other buffer is ours again once its write is done.
+    current ^= 1;
+  }
+  failed = !ok;
+  setp(buffers[current], buffers[current] + SINK_BUFFER);
+  return ok;
+}
+
+UringSink::int_type UringSink::overflow(int_type c) {
+  if (!flushBuffer()) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+int UringSink::sync() {
+  //endl flushes every line, and waiting for each would make it a write per line again. The write is in flight, that's enough.
+  return flushBuffer() ? 0 : -1;
+}
+
+bool UringSink::finish() {
+  bool ok = flushBuffer();
+  if (use_ring && !complete()) {
+    ok = false;
+  }
+  failed = failed || !ok;
+  return ok;
+}
+
+/* UringSink end */
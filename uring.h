@@ -0,0 +1,73 @@
+#ifndef SMASH_URING_H_
+#define SMASH_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <streambuf>
+#include <linux/io_uring.h>
+
+/* A bare io_uring, set up with the raw syscalls (no liburing). Get an sqe with next(), fill it,
+then submit() sends everything filled so far and can wait for completions, which reap() hands out. */
+class Uring {
+  int fd = -1;
+  void* sq_ring = nullptr;
+  void* cq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqes_size = 0;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  io_uring_cqe* cqes;
+  unsigned entries = 0;
+  unsigned features = 0; // The IORING_FEAT_ flags of the kernel.
+  unsigned pending = 0; // Filled sqes not yet submitted.
+ public:
+  explicit Uring(unsigned depth); // Check ok(), errno tells why when it isn't.
+  ~Uring();
+  Uring(Uring const&) = delete;
+  void operator=(Uring const&) = delete;
+  bool ok() const { return fd != -1; }
+  bool has(unsigned feature) const { return features & feature; }
+  io_uring_sqe* next(); // nullptr when the submission queue is full.
+  int submit(unsigned wait_for); // Returns -1 and sets errno on failure.
+  bool reap(io_uring_cqe& cqe); // Takes one completion, false if there's none.
+  void prepare(io_uring_sqe* sqe, uint8_t opcode, int fd, void* buffer, unsigned len, uint64_t offset,
+               uint64_t user_data);
+};
+
+#define SINK_BUFFER (64 * 1024)
+
+/* Output of a builtin that runs in the shell under a redirection (jobs > file). cout writes into one buffer
+while the other one is being written out through the io_uring, so formatting and writing overlap.
+The writes go one at a time at the file position, so the order is kept for any fd (pipes and >> too).
+Without a usable io_uring (one that can write at the file position), it's plain write. */
+class UringSink : public std::streambuf {
+  int target;
+  Uring ring;
+  bool use_ring;
+  char buffers[2][SINK_BUFFER];
+  int current = 0;
+  const char* flight = nullptr; // What's left of the write in flight.
+  size_t flight_left = 0;
+  bool failed = false; // After a write error the rest is dropped, the error was printed once.
+  bool send(const char* data, size_t len);
+  bool complete(); // Waits for the write in flight.
+  bool flushBuffer();
+ protected:
+  int_type overflow(int_type c) override;
+  int sync() override;
+ public:
+  explicit UringSink(int target);
+  ~UringSink();
+  UringSink(UringSink const&) = delete;
+  void operator=(UringSink const&) = delete;
+  bool finish(); // Writes out everything and waits for it. false if some of it couldn't be written.
+};
+
+#endif //SMASH_URING_H_